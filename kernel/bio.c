@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -12,6 +12,19 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+//
+// Buffers are hashed by (dev, blockno) into NBUCKET buckets,
+// each with its own lock, so that lookups and releases of
+// different blocks don't contend.  Instead of keeping a global
+// LRU list, brelse() stamps a buffer with the time it became
+// unused, and bget() recycles the unused buffer with the
+// oldest stamp.  Recycling moves a buffer between buckets; it
+// is serialized by bcache.lock, which is only taken on a miss.
+//
+// breadahead() starts reads without waiting for them.  The
+// buffer stays locked while the disk fills it, and
+// virtio_disk_intr() calls bdone() to release it, so that
+// a later bread() waits for the data rather than reading again.
 
 
 #include "types.h"
@@ -23,69 +36,187 @@
 #include "fs.h"
 #include "buf.h"
 
-struct {
+#define NBUCKET 13
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf head;   // list of buffers through prev/next
+};
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+struct {
+  struct spinlock lock;  // serializes recycling
+  struct buf buf[NBUF];
+  struct bucket bucket[NBUCKET];
 } bcache;
 
+static struct bucket*
+hash(uint dev, uint blockno)
+{
+  return &bcache.bucket[(dev * 31 + blockno) % NBUCKET];
+}
+
+// Insert b at the front of bucket bk.  Caller holds bk->lock.
+static void
+bucketins(struct bucket *bk, struct buf *b)
+{
+  b->next = bk->head.next;
+  b->prev = &bk->head;
+  bk->head.next->prev = b;
+  bk->head.next = b;
+}
+
+// Remove b from its bucket.  Caller holds that bucket's lock.
+static void
+bucketdel(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
+// Look for block (dev, blockno) in bucket bk.
+// Caller holds bk->lock.
+static struct buf*
+bucketfind(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head.next; b != &bk->head; b = b->next){
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  }
+  return 0;
+}
+
 void
 binit(void)
 {
+  struct bucket *bk;
   struct buf *b;
 
   initlock(&bcache.lock, "bcache");
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    initlock(&bk->lock, "bcache.bucket");
+    bk->head.prev = &bk->head;
+    bk->head.next = &bk->head;
+  }
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
+  // Spread the buffers over the buckets.
   for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    bucketins(&bcache.bucket[(b - bcache.buf) % NBUCKET], b);
   }
 }
 
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
+// For read-ahead (ra is 1), instead return 0 if the block is
+// already cached, or if fewer than half the buffers are
+// unused, so that read-ahead can't starve other users.
 static struct buf*
-bget(uint dev, uint blockno)
+bget(uint dev, uint blockno, int ra)
 {
-  struct buf *b;
+  struct bucket *bk, *victimbk, *obk;
+  struct buf *b, *victim;
+  int nfree;
 
-  acquire(&bcache.lock);
+  bk = hash(dev, blockno);
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  acquire(&bk->lock);
+  b = bucketfind(bk, dev, blockno);
+  if(b && !ra)
+    b->refcnt++;
+  release(&bk->lock);
+  if(b){
+    if(ra)
+      return 0;
+    acquiresleep(&b->lock);
+    return b;
   }
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  // Not cached.  Only one process at a time may recycle, so
+  // look again in case another process cached the block
+  // while bk->lock was released.
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  b = bucketfind(bk, dev, blockno);
+  if(b && !ra)
+    b->refcnt++;
+  release(&bk->lock);
+  if(b){
+    release(&bcache.lock);
+    if(ra)
+      return 0;
+    acquiresleep(&b->lock);
+    return b;
+  }
+
+  // Recycle the least recently used unused buffer.  Keep the
+  // lock of the bucket holding the best candidate so far, so
+  // it can't be taken meanwhile.  Holding two bucket locks is
+  // safe because only the holder of bcache.lock does it.
+  victim = 0;
+  victimbk = 0;
+  nfree = 0;
+  for(obk = bcache.bucket; obk < bcache.bucket+NBUCKET; obk++){
+    int found = 0;
+    acquire(&obk->lock);
+    for(b = obk->head.next; b != &obk->head; b = b->next){
+      if(b->refcnt != 0)
+        continue;
+      nfree++;
+      if(victim == 0 || b->lastuse < victim->lastuse){
+        victim = b;
+        found = 1;
+      }
     }
+    if(found){
+      if(victimbk)
+        release(&victimbk->lock);
+      victimbk = obk;
+    } else {
+      release(&obk->lock);
+    }
+  }
+  if(ra && nfree <= NBUF/2){
+    if(victimbk)
+      release(&victimbk->lock);
+    release(&bcache.lock);
+    return 0;
+  }
+  if(victim == 0)
+    panic("bget: no buffers");
+
+  bucketdel(victim);
+  victim->dev = dev;
+  victim->blockno = blockno;
+  victim->valid = 0;
+  victim->refcnt = 1;
+  if(victimbk != bk){
+    release(&victimbk->lock);
+    acquire(&bk->lock);
+  }
+  bucketins(bk, victim);
+  release(&bk->lock);
+  release(&bcache.lock);
+
+  acquiresleep(&victim->lock);
+  return victim;
+}
+
+// Submit disk requests for the n locked bufs in b,
+// one per run of up to MAXSG consecutive blocks.
+static void
+bsubmit(struct buf **b, int n, int write)
+{
+  int i, m;
+
+  for(i = 0; i < n; i += m){
+    for(m = 1; m < MAXSG && i + m < n && b[i+m]->blockno == b[i]->blockno + m; m++)
+      ;
+    virtio_disk_submitv(b + i, m, write);
   }
-  panic("bget: no buffers");
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -94,7 +225,7 @@ bread(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
+  b = bget(dev, blockno, 0);
   if(!b->valid) {
     virtio_disk_rw(b, 0);
     b->valid = 1;
@@ -102,6 +233,78 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Make sure blocks blockno..blockno+n-1 are cached, reading
+// the missing ones with one disk request per run of
+// consecutive missing blocks.  n must be at most MAXSG.
+void
+breadn(uint dev, uint blockno, int n)
+{
+  struct buf *b[MAXSG], *bp;
+  int i, nb;
+
+  if(n > MAXSG)
+    panic("breadn");
+
+  // blocks are locked in ascending order, as
+  // in any other breadn(), so this can't deadlock.
+  nb = 0;
+  for(i = 0; i < n; i++){
+    bp = bget(dev, blockno + i, 0);
+    if(bp->valid)
+      brelse(bp);
+    else
+      b[nb++] = bp;
+  }
+  bsubmit(b, nb, 0);
+  for(i = 0; i < nb; i++){
+    virtio_disk_wait(b[i]);
+    b[i]->valid = 1;
+    brelse(b[i]);
+  }
+}
+
+// Start reading those of blocks blockno..blockno+n-1 that
+// aren't cached, and return without waiting.  Blocks are
+// skipped if buffers are short.  n must be at most MAXSG.
+void
+breadahead(uint dev, uint blockno, int n)
+{
+  struct buf *b[MAXSG], *bp;
+  int i, nb;
+
+  if(n > MAXSG)
+    panic("breadahead");
+
+  nb = 0;
+  for(i = 0; i < n; i++){
+    if((bp = bget(dev, blockno + i, 1)) == 0)
+      continue;
+    bp->async = 1;
+    b[nb++] = bp;
+  }
+  bsubmit(b, nb, 0);
+}
+
+// Called by virtio_disk_intr() when the disk has finished
+// a read started by breadahead(): b now holds the block.
+// Release b on behalf of the process that started the read.
+void
+bdone(struct buf *b)
+{
+  struct bucket *bk;
+
+  b->async = 0;
+  b->valid = 1;
+  releasesleep(&b->lock);
+
+  bk = hash(b->dev, b->blockno);
+  acquire(&bk->lock);
+  b->refcnt--;
+  if (b->refcnt == 0)
+    b->lastuse = ticks;
+  release(&bk->lock);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -111,43 +314,64 @@ bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
+// Start writing the n locked bufs in b, with one disk
+// request per run of consecutive blocks (up to MAXSG blocks
+// each).  Call bwait() on each of them before changing
+// or releasing it.
+void
+bstartwritev(struct buf **b, int n)
+{
+  for(int i = 0; i < n; i++)
+    if(!holdingsleep(&b[i]->lock))
+      panic("bstartwritev");
+  bsubmit(b, n, 1);
+}
+
+// Wait for a write started by bstartwritev() to finish.
+void
+bwait(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwait");
+  virtio_disk_wait(b);
+}
+
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Record when it became unused, for recycling in bget().
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  bk = hash(b->dev, b->blockno);
+  acquire(&bk->lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->lastuse = ticks;
   }
-  
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = hash(b->dev, b->blockno);
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = hash(b->dev, b->blockno);
+
+  acquire(&bk->lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
-
-
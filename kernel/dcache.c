@@ -0,0 +1,130 @@
+//
+// Directory entry cache: remembers the results of dirlookup(),
+// so that looking up the same path again, as sh does for
+// every command it runs, needn't scan the directories.
+//
+// An entry maps (dev, directory inum, name) to the inum the
+// name refers to, or to 0 if the directory has no such name
+// (a negative entry).  dirlink() and unlink() keep the entries
+// of a directory up to date while holding its inode lock, the
+// same lock dirlookup() callers hold, and iput() drops all of
+// a directory's entries when it frees the directory.
+//
+// The cache is NDSET sets of NDWAY entries; an entry can only
+// live in the set its key hashes to, which evicts its least
+// recently used entry to make room.
+//
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "fs.h"
+#include "defs.h"
+
+#define NDSET 64
+#define NDWAY 4
+
+struct dentry {
+  uint dev;
+  uint dir;          // inum of the directory; 0 if the entry is free
+  uint inum;         // inum name refers to; 0 if none
+  uint used;         // when last used, for LRU eviction
+  char name[DIRSIZ];
+};
+
+static struct {
+  struct spinlock lock;
+  struct dentry set[NDSET][NDWAY];
+  uint clock;        // counts uses
+} dcache;
+
+void
+dcacheinit(void)
+{
+  initlock(&dcache.lock, "dcache");
+}
+
+static struct dentry*
+dset(uint dev, uint dir, char *name)
+{
+  uint h = dev * 31 + dir;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + name[i];
+  return dcache.set[h % NDSET];
+}
+
+// Find the entry for name in set s, or 0.
+// Caller must hold dcache.lock.
+static struct dentry*
+dfind(struct dentry *s, uint dev, uint dir, char *name)
+{
+  for(struct dentry *d = s; d < s + NDWAY; d++){
+    if(d->dir == dir && d->dev == dev && strncmp(d->name, name, DIRSIZ) == 0)
+      return d;
+  }
+  return 0;
+}
+
+// Look name up in directory dir on device dev.
+// Returns 1 and sets *inum, to 0 if the directory has no
+// such name, if the answer is cached; 0 if it isn't.
+int
+dcachelookup(uint dev, uint dir, char *name, uint *inum)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  d = dfind(dset(dev, dir, name), dev, dir, name);
+  if(d){
+    d->used = ++dcache.clock;
+    *inum = d->inum;
+  }
+  release(&dcache.lock);
+  return d != 0;
+}
+
+// Remember that name in directory dir on device dev refers
+// to inum, or, if inum is 0, that there is no such name.
+void
+dcacheenter(uint dev, uint dir, char *name, uint inum)
+{
+  struct dentry *s, *d;
+
+  acquire(&dcache.lock);
+  s = dset(dev, dir, name);
+  if((d = dfind(s, dev, dir, name)) == 0){
+    // take a free or the least recently used entry.
+    d = s;
+    for(struct dentry *e = s; e < s + NDWAY; e++){
+      if(e->dir == 0){
+        d = e;
+        break;
+      }
+      if(e->used < d->used)
+        d = e;
+    }
+    d->dev = dev;
+    d->dir = dir;
+    strncpy(d->name, name, DIRSIZ);
+  }
+  d->inum = inum;
+  d->used = ++dcache.clock;
+  release(&dcache.lock);
+}
+
+// Forget every entry of directory dir on device dev,
+// which is being freed.
+void
+dcachepurge(uint dev, uint dir)
+{
+  acquire(&dcache.lock);
+  for(int i = 0; i < NDSET; i++){
+    for(struct dentry *d = dcache.set[i]; d < dcache.set[i] + NDWAY; d++){
+      if(d->dir == dir && d->dev == dev)
+        d->dir = 0;
+    }
+  }
+  release(&dcache.lock);
+}
@@ -8,12 +8,19 @@ struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct kmem_cache;
+struct vm;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bstartwritev(struct buf**, int);
+void            breadn(uint, uint, int);
+void            breadahead(uint, uint, int);
+void            bdone(struct buf*);
+void            bwait(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
 
@@ -24,6 +31,13 @@ void            consputc(int);
 
 // exec.c
 int             exec(char*, char**);
+int             loadpage(struct proc*, uint64, char*);
+
+// dcache.c
+void            dcacheinit(void);
+int             dcachelookup(uint, uint, char*, uint*);
+void            dcacheenter(uint, uint, char*, uint);
+void            dcachepurge(uint, uint);
 
 // file.c
 struct file*    filealloc(void);
@@ -33,6 +47,9 @@ void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
+int             filereadi(struct file*, int, uint64, int);
+int             filewritei(struct file*, int, uint64, int);
+int             filesplice(struct file*, struct file*, int);
 
 // fs.c
 void            fsinit(int);
@@ -63,31 +80,53 @@ void            ramdiskrw(struct buf*);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void            kdup(void *);
+int             krefs(void *);
+void*           kalloc_order(int);
+void            kfree_order(void *, int);
+void            ksplit(void *, int);
+int             kstats(char*, int);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
+void            log_sync(void);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
 int             pipewrite(struct pipe*, uint64, int);
+int             pipesplicein(struct pipe*, struct file*, int);
+int             pipespliceout(struct pipe*, struct file*, int);
 
 // printf.c
 void            printf(char*, ...);
 void            panic(char*) __attribute__((noreturn));
 void            printfinit(void);
 
+// sprintf.c
+int             snprintf(char*, int, char*, ...);
+
+// stats.c
+void            statsinit(void);
+
+// futex.c
+void            futexinit(void);
+int             futex(uint64, int, int);
+
 // proc.c
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
+int             clone(uint64, uint64, uint64);
+int             join(int, uint64);
 int             growproc(int);
 pagetable_t     proc_pagetable(struct proc *);
-void            proc_freepagetable(pagetable_t, uint64);
+void            proc_freepagetable(pagetable_t, pagetable_t, uint64);
 int             kill(int);
 struct cpu*     mycpu(void);
 struct cpu*     getmycpu(void);
@@ -98,9 +137,13 @@ void            sched(void);
 void            setproc(struct proc*);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
+void            kproc(char*, void (*)(void));
 int             wait(uint64);
 void            wakeup(void*);
 void            yield(void);
+void            timeslice(void);
+void            boost(void);
+int             setpriority(int, int);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
@@ -108,6 +151,10 @@ void            procdump(void);
 // swtch.S
 void            swtch(struct context*, struct context*);
 
+// ucopy.S
+int             ucopy(void*, void*, uint64);
+int             ucopystr(char*, char*, uint64);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
@@ -115,6 +162,14 @@ void            initlock(struct spinlock*, char*);
 void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
+void            freelock(struct spinlock*);
+int             statslock(char*, int);
+
+// slab.c
+struct kmem_cache* kmem_cache_create(char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+int             slabstats(char*, int);
 
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
@@ -122,6 +177,9 @@ void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
 
+// start.c
+int             timerfired(void);
+
 // string.c
 int             memcmp(const void*, const void*, uint);
 void*           memmove(void*, const void*, uint);
@@ -145,6 +203,7 @@ void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
+void            ipi(int);
 
 // uart.c
 void            uartinit(void);
@@ -163,7 +222,17 @@ pagetable_t     uvmcreate(void);
 void            uvminit(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
+uint64          uvmshrink(struct vm*, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmfault(struct proc*, uint64, int);
+uint64          uvmwaddr(pagetable_t, uint64);
+void            uvmprefault(pagetable_t, uint64, uint64, int);
+pagetable_t     ukvmcreate(pagetable_t);
+void            kvmswitch(void);
+void            uvmswitch(struct vm*);
+void            uvmflush(struct vm*);
+void            tlbpoll(void);
+void            ukvmfree(pagetable_t, pagetable_t);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
@@ -181,6 +250,9 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_submit(struct buf *, int);
+void            virtio_disk_submitv(struct buf **, int, int);
+void            virtio_disk_wait(struct buf *);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
@@ -6,6 +6,9 @@
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
 
 static int loadseg(pde_t *pgdir, uint64 addr, struct inode *ip, uint offset, uint sz);
 
@@ -13,13 +16,19 @@ int
 exec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nseg;
   uint64 argc, sz = 0, sp, ustack[MAXARG+1], stackbase;
   struct elfhdr elf;
-  struct inode *ip;
+  struct inode *ip, *execip = 0, *oldexec;
   struct proghdr ph;
-  pagetable_t pagetable = 0, oldpagetable;
+  struct seg segs[NSEG];
+  pagetable_t pagetable = 0, kpagetable = 0, oldpagetable, oldkpagetable;
   struct proc *p = myproc();
+  struct vm *vm = p->vm;
+
+  // the other threads would be left without a program.
+  if(vm->ref > 1)
+    return -1;
 
   begin_op();
 
@@ -37,8 +46,14 @@ exec(char *path, char **argv)
 
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
+  if((kpagetable = ukvmcreate(pagetable)) == 0)
+    goto bad;
 
-  // Load program into memory.
+  // Map program segments. The first NSEG are loaded lazily,
+  // a page at a time, when the program first touches them
+  // (see loadpage()); any others are read in now.
+  memset(segs, 0, sizeof(segs));
+  nseg = 0;
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -48,26 +63,41 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
+    if(ph.vaddr + ph.memsz >= USERTOP)
+      goto bad;
+    if(ph.vaddr % PGSIZE != 0)
+      goto bad;
+    if(nseg < NSEG){
+      segs[nseg].va = ph.vaddr;
+      segs[nseg].filesz = ph.filesz;
+      segs[nseg].off = ph.off;
+      nseg++;
+      if(ph.vaddr + ph.memsz > sz)
+        sz = ph.vaddr + ph.memsz;
+      continue;
+    }
     uint64 sz1;
     if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz)) == 0)
       goto bad;
     sz = sz1;
-    if(ph.vaddr % PGSIZE != 0)
-      goto bad;
     if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
       goto bad;
   }
-  iunlockput(ip);
+  // keep a reference to the program file, to load pages from.
+  iunlock(ip);
   end_op();
+  execip = ip;
   ip = 0;
 
   p = myproc();
-  uint64 oldsz = p->sz;
+  uint64 oldsz = vm->sz;
 
   // Allocate two pages at the next page boundary.
   // Use the second as the user stack.
   sz = PGROUNDUP(sz);
   uint64 sz1;
+  if(sz + 2*PGSIZE > USERTOP)
+    goto bad;
   if((sz1 = uvmalloc(pagetable, sz, sz + 2*PGSIZE)) == 0)
     goto bad;
   sz = sz1;
@@ -108,23 +138,47 @@ exec(char *path, char **argv)
       last = s+1;
   safestrcpy(p->name, last, sizeof(p->name));
     
-  // Commit to the user image.
+  // Commit to the user image.  p is the only thread, so
+  // nobody else looks at vm; p's trapframe moves to slot 0.
   oldpagetable = p->pagetable;
+  oldkpagetable = vm->kpagetable;
+  oldexec = vm->exec;
+  uvmunmap(oldpagetable, THREADFRAME(p->tslot), 1, 0);
+  p->tslot = 0;
+  vm->slots = 1;
+  vm->pagetable = pagetable;
+  vm->kpagetable = kpagetable;
+  vm->asid = 0;
+  vm->stale = 0;
   p->pagetable = pagetable;
-  p->sz = sz;
+  vm->sz = sz;
+  vm->guard = sz - 2*PGSIZE;
+  vm->exec = execip;
+  memmove(vm->segs, segs, sizeof(segs));
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
-  proc_freepagetable(oldpagetable, oldsz);
+  uvmswitch(vm);
+  proc_freepagetable(oldpagetable, oldkpagetable, oldsz);
+  if(oldexec){
+    begin_op();
+    iput(oldexec);
+    end_op();
+  }
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
  bad:
   if(pagetable)
-    proc_freepagetable(pagetable, sz);
+    proc_freepagetable(pagetable, kpagetable, sz);
   if(ip){
     iunlockput(ip);
     end_op();
   }
+  if(execip){
+    begin_op();
+    iput(execip);
+    end_op();
+  }
   return -1;
 }
 
@@ -155,3 +209,39 @@ loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz
   
   return 0;
 }
+
+// Fill the zeroed page mem, about to be mapped at page-aligned
+// user address va in p, with the contents of the program file
+// if va lies in one of p's lazily loaded segments.
+// Called without p->vm->lock, which is never held across
+// reading the file.
+// Returns 0 on success, -1 if the file could not be read.
+int
+loadpage(struct proc *p, uint64 va, char *mem)
+{
+  struct seg *s;
+  uint n;
+  int r;
+  struct vm *vm = p->vm;
+
+  for(s = vm->segs; s < &vm->segs[NSEG]; s++){
+    if(s->filesz == 0 || va < s->va || va >= s->va + s->filesz)
+      continue;
+    n = PGSIZE;
+    if(s->va + s->filesz - va < PGSIZE)
+      n = s->va + s->filesz - va;
+    // a copy to or from this page by readi() or writei()
+    // gets here holding an inode's lock and a buffer's, and
+    // locking the program file could deadlock with another
+    // process doing the same the other way round.
+    // filereadi() and filewritei() fault user pages in
+    // before locking, so just fail.
+    if(p->nsleep > 0)
+      return -1;
+    ilock(vm->exec);
+    r = readi(vm->exec, 0, (uint64)mem, s->off + (va - s->va), n);
+    iunlock(vm->exec);
+    return r == n ? 0 : -1;
+  }
+  return 0;
+}
@@ -15,14 +15,13 @@
 
 struct devsw devsw[NDEV];
 struct {
-  struct spinlock lock;
-  struct file file[NFILE];
+  struct kmem_cache *cache;
 } ftable;
 
 void
 fileinit(void)
 {
-  initlock(&ftable.lock, "ftable");
+  ftable.cache = kmem_cache_create("file", sizeof(struct file));
 }
 
 // Allocate a file structure.
@@ -31,27 +30,22 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = kmem_cache_alloc(ftable.cache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
-// Increment ref count for file f.
+// Increment ref count for file f, which the caller already
+// holds a reference to, e.g. through a file descriptor.
+// Atomic rather than under a lock, since every read() and
+// write() takes a reference.
 struct file*
 filedup(struct file *f)
 {
-  acquire(&ftable.lock);
-  if(f->ref < 1)
+  if(__sync_fetch_and_add(&f->ref, 1) < 1)
     panic("filedup");
-  f->ref++;
-  release(&ftable.lock);
   return f;
 }
 
@@ -60,18 +54,17 @@ void
 fileclose(struct file *f)
 {
   struct file ff;
+  int n;
 
-  acquire(&ftable.lock);
-  if(f->ref < 1)
+  n = __sync_sub_and_fetch(&f->ref, 1);
+  if(n < 0)
     panic("fileclose");
-  if(--f->ref > 0){
-    release(&ftable.lock);
+  if(n > 0)
     return;
-  }
+  // that was the last reference, so nobody else uses f.
   ff = *f;
-  f->ref = 0;
   f->type = FD_NONE;
-  release(&ftable.lock);
+  kmem_cache_free(ftable.cache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -118,10 +111,7 @@ fileread(struct file *f, uint64 addr, int n)
       return -1;
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
-    ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
-      f->off += r;
-    iunlock(f->ip);
+    r = filereadi(f, 1, addr, n);
   } else {
     panic("fileread");
   }
@@ -129,12 +119,33 @@ fileread(struct file *f, uint64 addr, int n)
   return r;
 }
 
+// Read from the inode of file f, at its offset, to
+// dst, a user virtual address if user_dst is 1, or a
+// kernel address.
+int
+filereadi(struct file *f, int user_dst, uint64 dst, int n)
+{
+  int r;
+
+  // loadpage() won't read a lazily loaded page of a program
+  // while an inode is locked, so fault the pages of dst in
+  // first; readi() stops at one that can't be.
+  if(user_dst)
+    uvmprefault(myproc()->pagetable, dst, n, 1);
+
+  ilock(f->ip);
+  if((r = readi(f->ip, user_dst, dst, f->off, n)) > 0)
+    f->off += r;
+  iunlock(f->ip);
+  return r;
+}
+
 // Write to file f.
 // addr is a user virtual address.
 int
 filewrite(struct file *f, uint64 addr, int n)
 {
-  int r, ret = 0;
+  int ret = 0;
 
   if(f->writable == 0)
     return -1;
@@ -146,33 +157,7 @@ filewrite(struct file *f, uint64 addr, int n)
       return -1;
     ret = devsw[f->major].write(1, addr, n);
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
-    // this really belongs lower down, since writei()
-    // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
-    int i = 0;
-    while(i < n){
-      int n1 = n - i;
-      if(n1 > max)
-        n1 = max;
-
-      begin_op();
-      ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
-        f->off += r;
-      iunlock(f->ip);
-      end_op();
-
-      if(r < 0)
-        break;
-      if(r != n1)
-        panic("short filewrite");
-      i += r;
-    }
-    ret = (i == n ? n : -1);
+    ret = filewritei(f, 1, addr, n);
   } else {
     panic("filewrite");
   }
@@ -180,3 +165,61 @@ filewrite(struct file *f, uint64 addr, int n)
   return ret;
 }
 
+// Write to the inode of file f, at its offset, from
+// src, a user virtual address if user_src is 1, or a
+// kernel address.  Returns n, or -1 on error.
+int
+filewritei(struct file *f, int user_src, uint64 src, int n)
+{
+  int r;
+
+  // write a few blocks at a time to avoid exceeding
+  // the maximum log transaction size, including
+  // i-node, indirect block, allocation blocks,
+  // and 2 blocks of slop for non-aligned writes.
+  // this really belongs lower down, since writei()
+  // might be writing a device like the console.
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  int i = 0;
+
+  // as in filereadi().
+  if(user_src)
+    uvmprefault(myproc()->pagetable, src, n, 0);
+
+  while(i < n){
+    int n1 = n - i;
+    if(n1 > max)
+      n1 = max;
+
+    begin_op();
+    ilock(f->ip);
+    if ((r = writei(f->ip, user_src, src + i, f->off, n1)) > 0)
+      f->off += r;
+    iunlock(f->ip);
+    end_op();
+
+    if(r != n1){
+      // error from writei
+      break;
+    }
+    i += r;
+  }
+  return (i == n ? n : -1);
+}
+
+// Move up to n bytes between file in and file out, one
+// of which must be a pipe and the other an inode, without
+// copying them through user space.  Returns the number of
+// bytes moved, or -1.
+int
+filesplice(struct file *in, struct file *out, int n)
+{
+  if(in->readable == 0 || out->writable == 0 || n < 0)
+    return -1;
+  if(in->type == FD_INODE && out->type == FD_PIPE)
+    return pipesplicein(out->pipe, in, n);
+  if(in->type == FD_PIPE && out->type == FD_INODE)
+    return pipespliceout(in->pipe, out, n);
+  return -1;
+}
+
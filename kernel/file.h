@@ -1,6 +1,6 @@
 struct file {
   enum { FD_NONE, FD_PIPE, FD_INODE, FD_DEVICE } type;
-  int ref; // reference count
+  int ref; // reference count, updated atomically
   char readable;
   char writable;
   struct pipe *pipe; // FD_PIPE
@@ -27,6 +27,17 @@ struct inode {
   short nlink;
   uint size;
   uint addrs[NDIRECT+1];
+
+  // sequential read-ahead state, see readahead() in fs.c.
+  uint ranext;        // file block where the next sequential read starts
+  uint rawin;         // read-ahead window, in blocks; 0 if not sequential
+  uint raend;         // first file block not yet read ahead
+
+  // protected by icache.lock.
+  struct inode *next;    // hash chain
+  struct inode *prev;
+  struct inode *lrunext; // LRU list of unreferenced inodes
+  struct inode *lruprev;
 };
 
 // map major device number to device functions.
@@ -38,3 +49,4 @@ struct devsw {
 extern struct devsw devsw[];
 
 #define CONSOLE 1
+#define STATS   2
@@ -127,18 +127,22 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in cache: an entry in the inode cache
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
+// * Referencing in cache: ip->ref tracks the number of
+//   in-memory pointers to an inode cache entry (open
 //   files and current directories). iget() finds or
 //   creates a cache entry and increments its ref; iput()
-//   decrements ref.
+//   decrements ref.  Entries come from a slab cache, so there
+//   is no fixed limit on their number.  An entry whose ref
+//   falls to zero stays cached, on an LRU list, so that a
+//   later iget() needn't read the inode from disk again;
+//   beyond NINODE such entries, the least recently used
+//   one is freed.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   cache entry is only correct when ip->valid is 1.
 //   ilock() reads the inode from
 //   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ip->valid when it frees the inode on disk.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -162,8 +166,9 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The icache.lock spin-lock protects the allocation of icache
-// entries. Since ip->ref indicates whether an entry is free,
+// The icache.lock spin-lock protects the hash table and LRU
+// list of icache entries. Since ip->ref indicates whether an
+// entry is in use,
 // and ip->dev and ip->inum indicate which i-node an entry
 // holds, one must hold icache.lock while using any of those fields.
 //
@@ -171,20 +176,57 @@ bfree(int dev, uint b)
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+// Entries are hashed by (dev, inum) into NIHASH chains.
+// NIHASH must not divide ihash()'s multiplier, 31, or
+// dev would drop out of the hash.
+#define NIHASH 61
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct kmem_cache *cache;
+  struct inode *hash[NIHASH];
+  // unreferenced entries, through lrunext/lruprev.
+  // lru.lrunext is the most recently used.
+  struct inode lru;
+  int nlru;
 } icache;
 
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&icache.lock, "icache");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&icache.inode[i].lock, "inode");
-  }
+  icache.cache = kmem_cache_create("inode", sizeof(struct inode));
+  icache.lru.lrunext = icache.lru.lruprev = &icache.lru;
+}
+
+static struct inode**
+ihash(uint dev, uint inum)
+{
+  return &icache.hash[(dev * 31 + inum) % NIHASH];
+}
+
+// Take ip off the LRU list.
+// Caller must hold icache.lock.
+static void
+lruremove(struct inode *ip)
+{
+  ip->lruprev->lrunext = ip->lrunext;
+  ip->lrunext->lruprev = ip->lruprev;
+  icache.nlru--;
+}
+
+// Remove ip from the cache and free it.
+// Caller must hold icache.lock.
+static void
+ifree(struct inode *ip)
+{
+  if(ip->prev)
+    ip->prev->next = ip->next;
+  else
+    *ihash(ip->dev, ip->inum) = ip->next;
+  if(ip->next)
+    ip->next->prev = ip->prev;
+  kmem_cache_free(icache.cache, ip);
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -242,31 +284,41 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip, **h;
 
   acquire(&icache.lock);
 
   // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+  h = ihash(dev, inum);
+  for(ip = *h; ip; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0)
+        lruremove(ip);
       release(&icache.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode cache entry.
-  if(empty == 0)
-    panic("iget: no inodes");
-
-  ip = empty;
+  // Make a new inode cache entry, recycling the least
+  // recently used unreferenced one if out of memory.
+  while((ip = kmem_cache_alloc(icache.cache)) == 0){
+    if(icache.nlru == 0)
+      panic("iget: no inodes");
+    ip = icache.lru.lruprev;
+    lruremove(ip);
+    ifree(ip);
+  }
+  initsleeplock(&ip->lock, "inode");
+  ip->next = *h;
+  ip->prev = 0;
+  if(*h)
+    (*h)->prev = ip;
+  *h = ip;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->ranext = ip->rawin = ip->raend = 0;
   release(&icache.lock);
 
   return ip;
@@ -323,8 +375,8 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode cache entry can
-// be recycled.
+// If that was the last reference, the inode cache entry
+// goes on the LRU list, or is freed if it isn't valid.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -343,6 +395,8 @@ iput(struct inode *ip)
 
     release(&icache.lock);
 
+    if(ip->type == T_DIR)
+      dcachepurge(ip->dev, ip->inum);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
@@ -353,7 +407,23 @@ iput(struct inode *ip)
     acquire(&icache.lock);
   }
 
-  ip->ref--;
+  if(--ip->ref == 0){
+    if(ip->valid){
+      ip->lrunext = icache.lru.lrunext;
+      ip->lruprev = &icache.lru;
+      ip->lrunext->lruprev = ip;
+      icache.lru.lrunext = ip;
+      icache.nlru++;
+      if(icache.nlru > NINODE){
+        ip = icache.lru.lruprev;
+        lruremove(ip);
+      } else {
+        ip = 0;
+      }
+    }
+    if(ip)
+      ifree(ip);
+  }
   release(&icache.lock);
 }
 
@@ -433,6 +503,7 @@ itrunc(struct inode *ip)
   }
 
   ip->size = 0;
+  ip->ranext = ip->rawin = ip->raend = 0;
   iupdate(ip);
 }
 
@@ -448,6 +519,72 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Make sure file blocks bn..last of ip are in the buffer
+// cache, as far as they are consecutive on disk (and at
+// most MAXSG of them), reading the missing ones with a
+// single disk request.  Returns the first block not covered.
+// Caller must hold ip->lock.
+static uint
+readrun(struct inode *ip, uint bn, uint last)
+{
+  uint addr, n;
+
+  addr = bmap(ip, bn);
+  for(n = 1; n < MAXSG && bn + n <= last; n++)
+    if(bmap(ip, bn + n) != addr + n)
+      break;
+  if(n > 1)
+    breadn(ip->dev, addr, n);
+  return bn + n;
+}
+
+// Sequential read-ahead.  The window starts at RAMIN blocks
+// and doubles, up to RAMAX, with each read that starts where
+// the previous one ended; any other read closes it.
+#define RAMIN 2
+#define RAMAX (2*MAXSG)
+
+// Called after a read of ip's file blocks bn..end (end is
+// where a sequential read would continue).  If reads have been
+// sequential, start asynchronous reads of up to a window's
+// worth of blocks past end.  Reads are only started once
+// less than half a window remains read ahead, so they go to
+// the disk in batches.
+// Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint bn, uint end)
+{
+  uint start, last, addr, n;
+
+  if(bn == ip->ranext){
+    if(ip->rawin == 0)
+      ip->rawin = RAMIN;
+    else if(ip->rawin < RAMAX)
+      ip->rawin *= 2;
+  } else {
+    ip->rawin = 0;
+    ip->raend = 0;
+  }
+  ip->ranext = end;
+  if(ip->rawin == 0 || ip->raend >= end + ip->rawin/2)
+    return;
+
+  start = end > ip->raend ? end : ip->raend;
+  last = end + ip->rawin;
+  if(last > (ip->size + BSIZE - 1) / BSIZE)
+    last = (ip->size + BSIZE - 1) / BSIZE;
+  while(start < last){
+    addr = bmap(ip, start);
+    for(n = 1; n < MAXSG && start + n < last; n++)
+      if(bmap(ip, start + n) != addr + n)
+        break;
+    breadahead(ip->dev, addr, n);
+    start += n;
+  }
+  if(last > ip->raend)
+    ip->raend = last;
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
@@ -455,7 +592,7 @@ stati(struct inode *ip, struct stat *st)
 int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, next;
   struct buf *bp;
 
   if(off > ip->size || off + n < off)
@@ -463,7 +600,10 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   if(off + n > ip->size)
     n = ip->size - off;
 
+  next = 0;
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
+    if(off/BSIZE >= next)
+      next = readrun(ip, off/BSIZE, (off + n - tot - 1)/BSIZE);
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
@@ -472,6 +612,8 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     }
     brelse(bp);
   }
+  if(tot > 0)
+    readahead(ip, (off - tot)/BSIZE, off/BSIZE);
   return tot;
 }
 
@@ -479,6 +621,8 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 // Caller must hold ip->lock.
 // If user_src==1, then src is a user virtual address;
 // otherwise, src is a kernel address.
+// Returns the number of bytes written, less than n if
+// part of src could not be read.
 int
 writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
@@ -510,7 +654,7 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
     iupdate(ip);
   }
 
-  return n;
+  return tot;
 }
 
 // Directories
@@ -521,41 +665,247 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
-// Look for a directory entry in a directory.
-// If found, set *poff to byte offset of entry.
-struct inode*
-dirlookup(struct inode *dp, char *name, uint *poff)
+// Look for name among the entries of dp from byte offset
+// off up to end.  Returns the entry's offset and sets *inum,
+// or returns -1 if there is no such entry.
+static int
+dirscan(struct inode *dp, char *name, uint off, uint end, uint *inum)
 {
-  uint off, inum;
   struct dirent de;
 
-  if(dp->type != T_DIR)
-    panic("dirlookup not DIR");
-
-  for(off = 0; off < dp->size; off += sizeof(de)){
+  for(; off < end; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
     if(de.inum == 0)
       continue;
     if(namecmp(name, de.name) == 0){
-      // entry matches path element
-      if(poff)
-        *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
+      *inum = de.inum;
+      return off;
     }
   }
+  return -1;
+}
 
+// If dp is an indexed directory, return its block 0,
+// locked; otherwise return 0.
+static struct buf*
+dirindexed(struct inode *dp)
+{
+  struct buf *bp;
+  struct dirtop *t;
+
+  if(dp->size < 2*BSIZE)
+    return 0;
+  bp = bread(dp->dev, bmap(dp, 0));
+  t = (struct dirtop*)bp->data;
+  if(t->head.inum == 0 && t->head.magic == DIRMAGIC)
+    return bp;
+  brelse(bp);
   return 0;
 }
 
+// Return the index entry of the leaf that holds the
+// names with hash h: the last whose hash isn't above h.
+static int
+dirleaf(struct dirtop *t, uint h)
+{
+  int lo = 0, hi = t->head.nleaf - 1, mid;
+
+  while(lo < hi){
+    mid = (lo + hi + 1) / 2;
+    if(IXHASH(t, mid) <= h)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+// Look for a directory entry in a directory.
+// If found, set *poff to byte offset of entry.
+// Callers that don't need the offset may get the
+// answer from the directory entry cache.
+struct inode*
+dirlookup(struct inode *dp, char *name, uint *poff)
+{
+  int off;
+  uint inum, bn;
+  struct buf *bp;
+  struct dirtop *t;
+
+  if(dp->type != T_DIR)
+    panic("dirlookup not DIR");
+
+  if(poff == 0 && dcachelookup(dp->dev, dp->inum, name, &inum))
+    return inum ? iget(dp->dev, inum) : 0;
+
+  if((bp = dirindexed(dp)) != 0){
+    // "." and ".." stay in block 0; name can only be in one leaf.
+    t = (struct dirtop*)bp->data;
+    bn = IXBN(t, dirleaf(t, dirhash(name)));
+    brelse(bp);
+    if((off = dirscan(dp, name, 0, 2*sizeof(struct dirent), &inum)) < 0)
+      off = dirscan(dp, name, bn*BSIZE, (bn+1)*BSIZE, &inum);
+  } else
+    off = dirscan(dp, name, 0, dp->size, &inum);
+
+  if(off < 0){
+    dcacheenter(dp->dev, dp->inum, name, 0);
+    return 0;
+  }
+  // entry matches path element
+  if(poff)
+    *poff = off;
+  dcacheenter(dp->dev, dp->inum, name, inum);
+  return iget(dp->dev, inum);
+}
+
+// Sort key of a directory entry: its name's hash,
+// or, for an empty entry, more than any hash.
+static uint64
+dirkey(struct dirent *de)
+{
+  return de->inum ? dirhash(de->name) : 1L<<32;
+}
+
+// Sort the n entries de by name hash, with empty entries last.
+static void
+dirsort(struct dirent *de, int n)
+{
+  struct dirent x;
+  uint64 key;
+  int i, j;
+
+  for(i = 1; i < n; i++){
+    x = de[i];
+    key = dirkey(&x);
+    for(j = i; j > 0 && key < dirkey(&de[j-1]); j--)
+      de[j] = de[j-1];
+    de[j] = x;
+  }
+}
+
+// Turn linear directory dp, whose only block is full, into
+// an indexed directory with a single leaf.
+static void
+dirconvert(struct inode *dp)
+{
+  struct buf *tbp, *lbp;
+  struct dirtop *t;
+
+  tbp = bread(dp->dev, bmap(dp, 0));
+  lbp = bread(dp->dev, bmap(dp, 1));
+  t = (struct dirtop*)tbp->data;
+  memmove(lbp->data, &t->head, BSIZE - 2*sizeof(struct dirent));
+  memset(&t->head, 0, BSIZE - 2*sizeof(struct dirent));
+  t->head.magic = DIRMAGIC;
+  t->head.nleaf = 1;
+  IXHASH(t, 0) = 0;
+  IXBN(t, 0) = 1;
+  log_write(lbp);
+  log_write(tbp);
+  brelse(lbp);
+  brelse(tbp);
+  dp->size = 2*BSIZE;
+  iupdate(dp);
+}
+
+// Split the full leaf of index entry i of indexed directory dp,
+// moving the names with the larger hashes to a new leaf at the
+// end of dp.  tbp is dp's block 0 and lbp the leaf, both locked.
+// Returns -1 if the index is full or all names hash alike.
+static int
+dirsplit(struct inode *dp, struct buf *tbp, struct buf *lbp, int i)
+{
+  struct dirtop *t = (struct dirtop*)tbp->data;
+  struct dirent *de = (struct dirent*)lbp->data;
+  struct buf *nbp;
+  uint bn, h;
+  int j, k;
+
+  if(t->head.nleaf >= NDIRLEAF)
+    return -1;
+
+  // split near the middle, but between different hashes,
+  // so that each hash lives in just one leaf.
+  dirsort(de, DPB);
+  for(k = DPB/2; k < DPB && dirhash(de[k].name) == dirhash(de[k-1].name); k++)
+    ;
+  if(k == DPB){
+    for(k = DPB/2; k > 0 && dirhash(de[k].name) == dirhash(de[k-1].name); k--)
+      ;
+    if(k == 0)
+      return -1;
+  }
+  h = dirhash(de[k].name);
+
+  bn = dp->size / BSIZE;
+  nbp = bread(dp->dev, bmap(dp, bn));
+  memmove(nbp->data, de + k, (DPB - k) * sizeof(*de));
+  memset(de + k, 0, (DPB - k) * sizeof(*de));
+  log_write(nbp);
+  log_write(lbp);
+  brelse(nbp);
+
+  for(j = t->head.nleaf; j > i + 1; j--){
+    IXHASH(t, j) = IXHASH(t, j-1);
+    IXBN(t, j) = IXBN(t, j-1);
+  }
+  IXHASH(t, i+1) = h;
+  IXBN(t, i+1) = bn;
+  t->head.nleaf++;
+  log_write(tbp);
+
+  dp->size += BSIZE;
+  iupdate(dp);
+  return 0;
+}
+
+// Add (name, inum) to indexed directory dp, splitting
+// the leaf it belongs in if that is full.
+static int
+dirinsert(struct inode *dp, char *name, uint inum)
+{
+  struct buf *tbp, *lbp;
+  struct dirtop *t;
+  struct dirent *de;
+  uint h = dirhash(name);
+  int i, j;
+
+  for(;;){
+    if((tbp = dirindexed(dp)) == 0)
+      panic("dirinsert");
+    t = (struct dirtop*)tbp->data;
+    i = dirleaf(t, h);
+    lbp = bread(dp->dev, bmap(dp, IXBN(t, i)));
+    de = (struct dirent*)lbp->data;
+    for(j = 0; j < DPB; j++){
+      if(de[j].inum == 0){
+        strncpy(de[j].name, name, DIRSIZ);
+        de[j].inum = inum;
+        log_write(lbp);
+        brelse(lbp);
+        brelse(tbp);
+        return 0;
+      }
+    }
+    j = dirsplit(dp, tbp, lbp, i);
+    brelse(lbp);
+    brelse(tbp);
+    if(j < 0)
+      return -1;
+  }
+}
+
 // Write a new directory entry (name, inum) into the directory dp.
+// Returns -1 if name is present or dp is full.
 int
 dirlink(struct inode *dp, char *name, uint inum)
 {
   int off;
   struct dirent de;
   struct inode *ip;
+  struct buf *bp;
 
   // Check that name is not present.
   if((ip = dirlookup(dp, name, 0)) != 0){
@@ -563,19 +913,35 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
-  // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if(de.inum == 0)
-      break;
-  }
+  if((bp = dirindexed(dp)) != 0)
+    brelse(bp);
+  else {
+    // Look for an empty dirent.
+    for(off = 0; off < dp->size; off += sizeof(de)){
+      if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+        panic("dirlink read");
+      if(de.inum == 0)
+        break;
+    }
 
-  strncpy(de.name, name, DIRSIZ);
-  de.inum = inum;
-  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-    panic("dirlink");
+    if(off < BSIZE || dp->size > BSIZE){
+      strncpy(de.name, name, DIRSIZ);
+      de.inum = inum;
+      if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+        panic("dirlink");
+      dcacheenter(dp->dev, dp->inum, name, inum);
+      return 0;
+    }
 
+    // the only block is full: index the directory.
+    // Larger linear directories, made by older
+    // kernels, just keep growing.
+    dirconvert(dp);
+  }
+
+  if(dirinsert(dp, name, inum) < 0)
+    return -1;
+  dcacheenter(dp->dev, dp->inum, name, inum);
   return 0;
 }
 
@@ -58,3 +58,53 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+
+// Entries per directory block.
+#define DPB (BSIZE / sizeof(struct dirent))
+
+// A directory is linear, a plain sequence of entries, until its
+// first block fills up; then it becomes indexed.  Block 0 of an
+// indexed directory keeps "." and "..", followed by a header and
+// an index whose entry i says that leaf block IXBN(t, i) holds
+// the names whose dirhash() lies from IXHASH(t, i) up to the next
+// entry's hash.  Header and index fill entries whose inum is 0,
+// so programs that read a directory see only empty entries there.
+#define DIRMAGIC 0x78646e69       // "indx"
+#define NDIRLEAF (2 * (DPB - 3))  // most leaves in an indexed directory
+
+struct dirhead {
+  ushort inum;       // always 0
+  ushort nleaf;      // number of leaves, and of index entries
+  uint magic;        // DIRMAGIC
+  uint pad[2];
+};
+
+// two index entries.
+struct dirindex {
+  ushort inum;       // always 0
+  ushort pad;
+  uint hash[2];      // smallest hash in the leaf
+  ushort bn[2];      // block number of the leaf in the directory
+};
+
+// block 0 of an indexed directory.
+struct dirtop {
+  struct dirent dot;
+  struct dirent dotdot;
+  struct dirhead head;
+  struct dirindex ix[DPB - 3];
+};
+
+#define IXHASH(t, i) ((t)->ix[(i)/2].hash[(i)%2])
+#define IXBN(t, i)   ((t)->ix[(i)/2].bn[(i)%2])
+
+// FNV-1a hash of a directory entry name.
+static inline uint
+dirhash(const char *name)
+{
+  uint h = 2166136261;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h;
+}
@@ -0,0 +1,151 @@
+//
+// futexes: sleeping on a word of user memory.
+//
+// futex_wait() sleeps only if the word still holds the value
+// the caller last saw, and futex_wake() wakes up to n of the
+// sleepers, so user code can build mutexes and condition
+// variables that spin only in the uncontended case.
+//
+// Waiters are identified by their address space and the user
+// virtual address of the word, which stay the same however the
+// page behind the address changes, by copy-on-write or sbrk().
+// Each waiter sleeps on its own struct futexwait, kept on one of
+// NFUTEX queues chosen by that key; the queue's lock makes
+// checking the word and going to sleep atomic with respect to
+// futex_wake().
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "futex.h"
+#include "defs.h"
+
+#define NFUTEX 31
+
+struct futexwait {
+  struct vm *vm;
+  uint64 va;
+  int woken;
+  struct futexwait *next;
+};
+
+static struct futexq {
+  struct spinlock lock;
+  struct futexwait *head;  // waiters, longest first
+} futexq[NFUTEX];
+
+void
+futexinit(void)
+{
+  for(int i = 0; i < NFUTEX; i++)
+    initlock(&futexq[i].lock, "futex");
+}
+
+static struct futexq*
+futexqueue(struct vm *vm, uint64 va)
+{
+  return &futexq[(((uint64)vm >> 4) + (va >> 2)) % NFUTEX];
+}
+
+// Read the int at user address va in vm into *val.
+// vm->lock keeps other threads from unmapping and
+// freeing the page meanwhile.  Doesn't fault the
+// page in, so it can't sleep.
+// Returns -1 if va isn't mapped.
+static int
+futexword(struct vm *vm, uint64 va, int *val)
+{
+  uint64 pa;
+
+  acquire(&vm->lock);
+  if((pa = walkaddr(vm->pagetable, PGROUNDDOWN(va))) == 0){
+    release(&vm->lock);
+    return -1;
+  }
+  *val = __atomic_load_n((int*)(pa + va % PGSIZE), __ATOMIC_SEQ_CST);
+  release(&vm->lock);
+  return 0;
+}
+
+// Sleep until woken by futex_wake() on addr, unless the
+// int at user address addr no longer holds val.
+// Returns 0 after sleeping (callers must recheck the word,
+// since a kill also wakes them), -1 if the word didn't hold
+// val or addr is bad.
+static int
+futex_wait(uint64 addr, int val)
+{
+  struct proc *p = myproc();
+  struct futexq *q = futexqueue(p->vm, addr);
+  struct futexwait w, **wp;
+  int cur;
+
+  // fault the page in, for futexword().
+  if(uvmwaddr(p->pagetable, addr) == 0)
+    return -1;
+  acquire(&q->lock);
+  if(futexword(p->vm, addr, &cur) < 0 || cur != val || p->killed){
+    release(&q->lock);
+    return -1;
+  }
+  w.vm = p->vm;
+  w.va = addr;
+  w.woken = 0;
+  w.next = 0;
+  for(wp = &q->head; *wp; wp = &(*wp)->next)
+    ;
+  *wp = &w;
+  while(!w.woken && !p->killed)
+    sleep(&w, &q->lock);
+  if(!w.woken){
+    for(wp = &q->head; *wp != &w; wp = &(*wp)->next)
+      ;
+    *wp = w.next;
+  }
+  release(&q->lock);
+  return 0;
+}
+
+// Wake up at most n processes waiting on addr.
+// Returns how many woke, or -1 if addr is bad.
+static int
+futex_wake(uint64 addr, int n)
+{
+  struct vm *vm = myproc()->vm;
+  struct futexq *q = futexqueue(vm, addr);
+  struct futexwait *w, **wp;
+  int woken = 0;
+
+  if(addr >= vm->sz)
+    return -1;
+  acquire(&q->lock);
+  for(wp = &q->head; (w = *wp) != 0 && woken < n; ){
+    if(w->vm == vm && w->va == addr){
+      *wp = w->next;
+      w->woken = 1;
+      wakeup(w);
+      woken++;
+    } else
+      wp = &w->next;
+  }
+  release(&q->lock);
+  return woken;
+}
+
+int
+futex(uint64 addr, int op, int val)
+{
+  if(addr % sizeof(int) != 0)
+    return -1;
+  switch(op){
+  case FUTEX_WAIT:
+    return futex_wait(addr, val);
+  case FUTEX_WAKE:
+    return futex_wake(addr, val);
+  }
+  return -1;
+}
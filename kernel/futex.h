@@ -0,0 +1,2 @@
+#define FUTEX_WAIT 0  // sleep if *addr still holds val
+#define FUTEX_WAKE 1  // wake up to val processes waiting on addr
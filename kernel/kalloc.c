@@ -1,6 +1,28 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers.
+//
+// Free memory is managed by a binary buddy allocator, in
+// blocks of 2^k pages (k is the block's order, at most
+// MAXORDER), each aligned to its size.  kalloc_order(k) splits
+// a larger block in halves if no block of order k is free;
+// kfree_order() merges a freed block with its buddy, the other
+// half of the block of order k+1 it came from, if that is free
+// too, and so on up.
+//
+// Single 4096-byte pages, by far the most common, come from a
+// per-CPU cache in front of the buddy allocator, protected by
+// its own lock, so that kalloc() and kfree() on different CPUs
+// don't contend.  A CPU whose cache is empty refills it with a
+// batch of pages from the buddy allocator, or, if that has none,
+// steals a batch from another CPU's cache; a CPU whose cache
+// grows too large gives a batch back.
+//
+// Every page also has a reference count, so that copy-on-write
+// fork() can share a page among several page tables.  kalloc()
+// returns a page with one reference, kdup() adds one, and kfree()
+// drops one, returning the page to a free list only when the
+// last reference goes away.  A block's count is its first page's.
 
 #include "types.h"
 #include "param.h"
@@ -9,6 +31,19 @@
 #include "riscv.h"
 #include "defs.h"
 
+// largest block order: 2^10 pages, 4MB.
+#define MAXORDER 10
+
+// pages moved between a CPU's cache and the buddy
+// allocator at once.
+#define NBATCH 32
+
+// most pages a CPU's cache holds.
+#define NCACHE 128
+
+// steal at most this many pages from another CPU at once.
+#define NSTEAL 64
+
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // first address after kernel.
@@ -18,15 +53,48 @@ struct run {
   struct run *next;
 };
 
-struct {
+struct kmem {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int nfree;         // number of pages on freelist
+};
+
+struct kmem kmem[NCPU];
+
+// per-page reference counts, indexed by physical page number.
+// updated with atomic instructions rather than under a lock,
+// so that kfree() stays contention-free.
+#define PA2REF(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define REF2PA(i) (KERNBASE + (uint64)(i) * PGSIZE)
+#define NPAGE PA2REF(PHYSTOP)
+int kref[NPAGE];
+
+// a free buddy block, kept in its first page.
+struct block {
+  struct block *next;
+  struct block *prev;
+};
+
+struct {
+  struct spinlock lock;
+  struct block free[MAXORDER+1]; // heads of circular free lists
+  int nfree[MAXORDER+1];         // number of blocks on each
+  uint drained;                  // ticks at the last kdrainall()
+} buddy;
+
+// 1 + the order of the free block that starts at each
+// page, or 0 if none does.  Protected by buddy.lock.
+static uchar bfree[NPAGE];
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem[i].lock, "kmem");
+  initlock(&buddy.lock, "kmem_buddy");
+  buddy.drained = ticks - 1;
+  for(int k = 0; k <= MAXORDER; k++)
+    buddy.free[k].next = buddy.free[k].prev = &buddy.free[k];
   freerange(end, (void*)PHYSTOP);
 }
 
@@ -35,31 +103,192 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    kref[PA2REF(p)] = 1;
+    kfree_order(p, 0);
+  }
+}
+
+// Put the block of order k at page i on its free list.
+// Caller must hold buddy.lock.
+static void
+bpush(uint64 i, int k)
+{
+  struct block *b = (struct block*)REF2PA(i);
+
+  b->next = buddy.free[k].next;
+  b->prev = &buddy.free[k];
+  b->next->prev = b;
+  buddy.free[k].next = b;
+  buddy.nfree[k]++;
+  bfree[i] = k + 1;
+}
+
+// Take the block of order k at page i off its free list.
+// Caller must hold buddy.lock.
+static void
+bremove(uint64 i, int k)
+{
+  struct block *b = (struct block*)REF2PA(i);
+
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+  buddy.nfree[k]--;
+  bfree[i] = 0;
+}
+
+// Free the block of order k at pa, merging it with its
+// buddies.  Caller must hold buddy.lock.
+static void
+bfreeblock(void *pa, int k)
+{
+  uint64 i = PA2REF(pa);
+  uint64 b;
+
+  for(; k < MAXORDER; k++){
+    b = i ^ (1L << k);
+    if(bfree[b] != k + 1)
+      break;
+    bremove(b, k);
+    i &= ~(1L << k);
+  }
+  bpush(i, k);
 }
 
-// Free the page of physical memory pointed at by v,
+// Allocate a block of order k, splitting a larger one if
+// need be.  Returns 0 if there is none.
+// Caller must hold buddy.lock.
+static void*
+balloc(int k)
+{
+  uint64 i;
+  int j;
+
+  for(j = k; j <= MAXORDER && buddy.nfree[j] == 0; j++)
+    ;
+  if(j > MAXORDER)
+    return 0;
+  i = PA2REF(buddy.free[j].next);
+  bremove(i, j);
+  // give back the upper halves.
+  while(j > k){
+    j--;
+    bpush(i + (1L << j), j);
+  }
+  return (void*)REF2PA(i);
+}
+
+// Move up to n pages from CPU id's cache to the buddy
+// allocator.  Caller must hold kmem[id].lock.
+static void
+kdrain(int id, int n)
+{
+  struct run *r;
+
+  acquire(&buddy.lock);
+  while(n-- > 0 && (r = kmem[id].freelist) != 0){
+    kmem[id].freelist = r->next;
+    kmem[id].nfree--;
+    bfreeblock(r, 0);
+  }
+  release(&buddy.lock);
+}
+
+// Move up to NBATCH pages from the buddy allocator
+// to CPU id's cache.
+// Caller must hold kmem[id].lock.
+static void
+krefill(int id)
+{
+  struct run *r;
+
+  acquire(&buddy.lock);
+  for(int n = 0; n < NBATCH && (r = balloc(0)) != 0; n++){
+    r->next = kmem[id].freelist;
+    kmem[id].freelist = r;
+    kmem[id].nfree++;
+  }
+  release(&buddy.lock);
+}
+
+// Drop a reference to the page of physical memory pointed at by pa,
 // which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// call to kalloc().
+// The page is freed when its last reference is dropped.
 void
 kfree(void *pa)
 {
   struct run *r;
+  int id, n;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  n = __sync_sub_and_fetch(&kref[PA2REF(pa)], 1);
+  if(n < 0)
+    panic("kfree: ref");
+  if(n > 0)
+    return;
+
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  id = cpuid();
+  acquire(&kmem[id].lock);
+  r->next = kmem[id].freelist;
+  kmem[id].freelist = r;
+  kmem[id].nfree++;
+  if(kmem[id].nfree > NCACHE)
+    kdrain(id, NBATCH);
+  release(&kmem[id].lock);
+  pop_off();
+}
+
+// Move up to half of another CPU's free pages (at most NSTEAL)
+// onto CPU id's free list, and return one of them.
+// Only one kmem lock is held at a time, so two CPUs
+// stealing from each other cannot deadlock.
+// Returns 0 if every CPU's list is empty.
+// Interrupts must be disabled.
+static struct run*
+ksteal(int id)
+{
+  struct run *first, *last;
+  int i, n, victim;
+
+  for(i = 1; i < NCPU; i++){
+    victim = (id + i) % NCPU;
+    acquire(&kmem[victim].lock);
+    first = kmem[victim].freelist;
+    if(first == 0){
+      release(&kmem[victim].lock);
+      continue;
+    }
+    n = (kmem[victim].nfree + 1) / 2;
+    if(n > NSTEAL)
+      n = NSTEAL;
+    last = first;
+    for(int j = 1; j < n; j++)
+      last = last->next;
+    kmem[victim].freelist = last->next;
+    kmem[victim].nfree -= n;
+    release(&kmem[victim].lock);
+
+    // keep the first page for the caller.
+    last->next = 0;
+    if(n > 1){
+      acquire(&kmem[id].lock);
+      last->next = kmem[id].freelist;
+      kmem[id].freelist = first->next;
+      kmem[id].nfree += n - 1;
+      release(&kmem[id].lock);
+    }
+    return first;
+  }
+  return 0;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -69,14 +298,163 @@ void *
 kalloc(void)
 {
   struct run *r;
+  int id;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  push_off();
+  id = cpuid();
+  acquire(&kmem[id].lock);
+  if(kmem[id].freelist == 0)
+    krefill(id);
+  r = kmem[id].freelist;
+  if(r){
+    kmem[id].freelist = r->next;
+    kmem[id].nfree--;
+  }
+  release(&kmem[id].lock);
+  if(r == 0)
+    r = ksteal(id);
+  pop_off();
 
-  if(r)
+  if(r){
     memset((char*)r, 5, PGSIZE); // fill with junk
+    kref[PA2REF(r)] = 1;
+  }
   return (void*)r;
 }
+
+// Give every CPU's cached pages back to the buddy allocator,
+// in case that lets blocks merge.  Done at most once a tick,
+// so that a stream of failing allocations doesn't keep
+// emptying the caches and taking every kmem lock.
+// Returns 0 if it didn't drain.
+static int
+kdrainall(void)
+{
+  uint t = ticks; // no tickslock; a stale value only delays a drain
+
+  acquire(&buddy.lock);
+  if(buddy.drained == t){
+    release(&buddy.lock);
+    return 0;
+  }
+  buddy.drained = t;
+  release(&buddy.lock);
+
+  for(int i = 0; i < NCPU; i++){
+    acquire(&kmem[i].lock);
+    kdrain(i, kmem[i].nfree);
+    release(&kmem[i].lock);
+  }
+  return 1;
+}
+
+// Allocate 2^k physically contiguous pages, aligned to
+// their size, with one reference.  If no block is big enough,
+// first tries kdrainall().
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_order(int k)
+{
+  void *pa;
+
+  if(k < 0 || k > MAXORDER)
+    return 0;
+  acquire(&buddy.lock);
+  pa = balloc(k);
+  release(&buddy.lock);
+  if(pa == 0 && kdrainall()){
+    acquire(&buddy.lock);
+    pa = balloc(k);
+    release(&buddy.lock);
+  }
+
+  if(pa){
+    memset(pa, 5, PGSIZE << k); // fill with junk
+    kref[PA2REF(pa)] = 1;
+  }
+  return pa;
+}
+
+// Drop a reference to the block of 2^k pages at pa,
+// returned by kalloc_order(k), and free the block
+// when its last reference is dropped.
+void
+kfree_order(void *pa, int k)
+{
+  int n;
+
+  if(k < 0 || k > MAXORDER || ((uint64)pa % (PGSIZE << k)) != 0 ||
+     (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kfree_order");
+
+  n = __sync_sub_and_fetch(&kref[PA2REF(pa)], 1);
+  if(n < 0)
+    panic("kfree_order: ref");
+  if(n > 0)
+    return;
+
+  // Fill with junk to catch dangling refs.
+  memset(pa, 1, PGSIZE << k);
+
+  acquire(&buddy.lock);
+  bfreeblock(pa, k);
+  release(&buddy.lock);
+}
+
+// Turn the block of 2^k pages at pa, which has one reference,
+// into 2^k pages with one reference each, to be freed one at
+// a time with kfree().
+void
+ksplit(void *pa, int k)
+{
+  if(k < 0 || k > MAXORDER || ((uint64)pa % (PGSIZE << k)) != 0 ||
+     (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("ksplit");
+  if(kref[PA2REF(pa)] != 1)
+    panic("ksplit: ref");
+  for(int i = 1; i < (1 << k); i++)
+    kref[PA2REF(pa) + i] = 1;
+}
+
+// Add a reference to the allocated page pa.
+void
+kdup(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kdup");
+  if(__sync_fetch_and_add(&kref[PA2REF(pa)], 1) < 1)
+    panic("kdup: free page");
+}
+
+// Return the number of references to the allocated page pa.
+int
+krefs(void *pa)
+{
+  return kref[PA2REF(pa)];
+}
+
+// Format fragmentation statistics for the physical memory
+// allocator into buf: the number of free blocks of each
+// order, then the number of free pages, how many of them are
+// in CPU caches, and the order of the largest free block
+// (-1 if none).  Returns the number of bytes written.
+int
+kstats(char *buf, int sz)
+{
+  int n = 0, k, free = 0, cached = 0, largest = -1;
+
+  for(int i = 0; i < NCPU; i++)
+    cached += kmem[i].nfree;
+  acquire(&buddy.lock);
+  n += snprintf(buf+n, sz-n, "--- buddy allocator\n");
+  for(k = 0; k <= MAXORDER; k++){
+    n += snprintf(buf+n, sz-n, "order %d: %d free\n", k, buddy.nfree[k]);
+    free += buddy.nfree[k] << k;
+    if(buddy.nfree[k] > 0)
+      largest = k;
+  }
+  release(&buddy.lock);
+  n += snprintf(buf+n, sz-n, "free pages: %d cached: %d largest: %d\n",
+                free + cached, cached, largest);
+  return n;
+}
@@ -19,7 +19,23 @@
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// asks for a commit and sleeps until it is done.
+//
+// Commits are done by a kernel process, the log daemon,
+// not by end_op().  A transaction stays open for
+// COMMITDELAY ticks, collecting the updates of many system
+// calls, which return as soon as their updates are in the
+// buffer cache.  A system call that needs its updates on
+// disk calls log_sync() (see fsync()).
+//
+// Commits are double-buffered.  To close a transaction, the
+// daemon keeps new ops out only until the running ones end
+// and it has copied the transaction's blocks out of the
+// cache.  A new transaction then opens, and may modify the
+// same cached blocks, while the daemon writes the copies to
+// the log and installs them from the copies.  Only the
+// committing transaction is ever on disk, so the on-disk
+// format is unchanged.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
@@ -28,7 +44,9 @@
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// Log appends are synchronous, though commit() keeps
+// several block writes in flight at once.  A new transaction
+// is not written to the log until the last one is installed.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
@@ -42,14 +60,38 @@ struct log {
   int start;
   int size;
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int committing;  // closing the open transaction, please wait.
+  int commitreq;   // someone wants the open transaction committed now.
+  uint opened;     // ticks when the open transaction got its first block.
+  int txn;         // number of the open transaction.
+  int done;        // number of the last committed transaction.
   int dev;
   struct logheader lh;
 };
 struct log log;
 
+// The committing transaction: its header, a copy of each of
+// its blocks taken when it closed, and the cache buffers it
+// pinned.  Used only by the log daemon, which holds the
+// copies' locks for good.
+static struct {
+  struct logheader lh;
+  struct buf copy[LOGSIZE];
+  struct buf *pinned[LOGSIZE];
+} ctx;
+
+// install_trans() starts up to this many block writes
+// before waiting for any of them.  Writes to consecutive
+// blocks go to the disk as a single request.
+#define NBATCH MAXSG
+
+// ticks the log daemon leaves a transaction open for.
+#define COMMITDELAY 1
+
 static void recover_from_log(void);
 static void commit();
+static void snapshot(void);
+static void logdaemon(void);
 
 void
 initlog(int dev, struct superblock *sb)
@@ -61,23 +103,36 @@ initlog(int dev, struct superblock *sb)
   log.start = sb->logstart;
   log.size = sb->nlog;
   log.dev = dev;
+  log.txn = 1;
+  for (int i = 0; i < LOGSIZE; i++)
+    initsleeplock(&ctx.copy[i].lock, "logcopy");
   recover_from_log();
+  kproc("logd", logdaemon);
 }
 
-// Copy committed blocks from log to their home location
+// Copy committed blocks from log to their home location,
+// when recovering after a crash.
 static void
 install_trans(void)
 {
-  int tail;
-
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  struct buf *dbuf[NBATCH];
+  int tail, i, n;
+
+  for (tail = 0; tail < log.lh.n; tail += n) {
+    n = log.lh.n - tail;
+    if (n > NBATCH)
+      n = NBATCH;
+    for (i = 0; i < n; i++) {
+      struct buf *lbuf = bread(log.dev, log.start+tail+i+1); // read log block
+      dbuf[i] = bread(log.dev, log.lh.block[tail+i]); // read dst
+      memmove(dbuf[i]->data, lbuf->data, BSIZE);  // copy block to dst
+      brelse(lbuf);
+    }
+    bstartwritev(dbuf, n);  // start writing dst to disk
+    for (i = 0; i < n; i++) {
+      bwait(dbuf[i]);
+      brelse(dbuf[i]);
+    }
   }
 }
 
@@ -97,16 +152,16 @@ read_head(void)
 
 // Write in-memory log header to disk.
 // This is the true point at which the
-// current transaction commits.
+// transaction commits.
 static void
-write_head(void)
+write_head(struct logheader *lh)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  hb->n = lh->n;
+  for (i = 0; i < lh->n; i++) {
+    hb->block[i] = lh->block[i];
   }
   bwrite(buf);
   brelse(buf);
@@ -118,10 +173,12 @@ recover_from_log(void)
   read_head();
   install_trans(); // if committed, copy from log to disk
   log.lh.n = 0;
-  write_head(); // clear the log
+  write_head(&log.lh); // clear the log
 }
 
 // called at the start of each FS system call.
+// only waits while a transaction is being closed,
+// not for its commit.
 void
 begin_op(void)
 {
@@ -131,6 +188,10 @@ begin_op(void)
       sleep(&log, &log.lock);
     } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
       // this op might exhaust log space; wait for commit.
+      if(log.lh.n > 0){
+        log.commitreq = 1;
+        wakeup(&log);
+      }
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
@@ -141,69 +202,135 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// the log daemon will commit the op's updates later.
 void
 end_op(void)
 {
-  int do_commit = 0;
-
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
+  // the log daemon may be waiting for outstanding ops to
+  // end, and begin_op() may be waiting for log space.
+  wakeup(&log);
+  release(&log.lock);
+}
+
+// Wait until the updates of every system call that has
+// called end_op() are on disk.
+void
+log_sync(void)
+{
+  int txn;
+
+  acquire(&log.lock);
+  if(log.lh.n > 0){
+    // the open transaction.
+    txn = log.txn;
+    log.commitreq = 1;
     wakeup(&log);
+  } else {
+    // the committing transaction, if any.
+    txn = log.txn - 1;
   }
+  while(log.done < txn)
+    sleep(&log, &log.lock);
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
+// The log daemon.  Commits the open transaction once it has
+// been open for COMMITDELAY ticks, or sooner if begin_op()
+// or log_sync() asks.
+static void
+logdaemon(void)
+{
+  int txn;
+
+  for (int i = 0; i < LOGSIZE; i++)
+    acquiresleep(&ctx.copy[i].lock);
+
+  acquire(&log.lock);
+  for(;;){
+    if(log.lh.n == 0){
+      sleep(&log, &log.lock);
+    } else if(!log.commitreq && ticks - log.opened < COMMITDELAY){
+      sleep(&ticks, &log.lock);
+    } else {
+      // keep new ops out, and wait for the running ones.
+      log.committing = 1;
+      while(log.outstanding > 0)
+        sleep(&log, &log.lock);
+      // copy w/o holding locks, since not allowed
+      // to sleep with locks.
+      release(&log.lock);
+      snapshot();
+      acquire(&log.lock);
+      txn = log.txn++;
+      log.lh.n = 0;
+      log.committing = 0;
+      log.commitreq = 0;
+      wakeup(&log);
+
+      // new ops run while the copy is written out.
+      release(&log.lock);
+      commit();
+      acquire(&log.lock);
+      log.done = txn;
+      wakeup(&log);
+    }
+  }
+}
+
+// Copy the closed transaction's header and blocks into ctx.
+// No ops are outstanding, so the cached blocks hold exactly
+// the transaction's updates.
+static void
+snapshot(void)
+{
+  int i;
+
+  ctx.lh = log.lh;
+  for (i = 0; i < ctx.lh.n; i++) {
+    struct buf *b = bread(log.dev, ctx.lh.block[i]); // cache block
+    memmove(ctx.copy[i].data, b->data, BSIZE);
+    ctx.pinned[i] = b;
+    brelse(b);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Write the copies in ctx to the log if tolog,
+// otherwise to their home locations.
 static void
-write_log(void)
+write_copies(int tolog)
 {
-  int tail;
-
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  struct buf *b[LOGSIZE];
+  int i;
+
+  for (i = 0; i < ctx.lh.n; i++) {
+    b[i] = &ctx.copy[i];
+    b[i]->dev = log.dev;
+    b[i]->blockno = tolog ? log.start+i+1 : ctx.lh.block[i];
   }
+  bstartwritev(b, ctx.lh.n);
+  for (i = 0; i < ctx.lh.n; i++)
+    bwait(b[i]);
 }
 
 static void
 commit()
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  if (ctx.lh.n > 0) {
+    write_copies(1);     // Write the copied blocks to the log
+    write_head(&ctx.lh); // Write header to disk -- the real commit
+    write_copies(0);     // Now install writes to home locations
+    for (int i = 0; i < ctx.lh.n; i++)
+      bunpin(ctx.pinned[i]);
+    ctx.lh.n = 0;
+    write_head(&ctx.lh); // Erase the transaction from the log
   }
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// snapshot()/commit() will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -228,6 +355,8 @@ log_write(struct buf *b)
   log.lh.block[i] = b->blockno;
   if (i == log.lh.n) {  // Add new block to log?
     bpin(b);
+    if (log.lh.n == 0)
+      log.opened = ticks;
     log.lh.n++;
   }
   release(&log.lock);
@@ -26,7 +26,11 @@ main()
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
     iinit();         // inode cache
+    dcacheinit();    // directory entry cache
     fileinit();      // file table
+    pipeinit();      // pipe cache
+    statsinit();     // lock statistics device
+    futexinit();     // futex locks
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
     __sync_synchronize();
@@ -25,8 +25,10 @@
 #define VIRTIO0 0x10001000
 #define VIRTIO0_IRQ 1
 
-// local interrupt controller, which contains the timer.
+// local interrupt controller, which contains the timer
+// and the inter-processor interrupt (software interrupt) bits.
 #define CLINT 0x2000000L
+#define CLINT_MSIP(hartid) (CLINT + 4*(hartid))
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
 
@@ -51,9 +53,19 @@
 // in both user and kernel space.
 #define TRAMPOLINE (MAXVA - PGSIZE)
 
-// map kernel stacks beneath the trampoline,
-// each surrounded by invalid guard pages.
-#define KSTACK(p) (TRAMPOLINE - ((p)+1)* 2*PGSIZE)
+// map kernel stacks beneath the trampoline and the
+// trapframes of user page tables (see below), each
+// surrounded by invalid guard pages.  kernel mappings
+// are global (PTE_G), so they must not share a virtual
+// address with anything in a user page table but the
+// trampoline.
+#define KSTACK(p) (THREADFRAME(NTHREAD) - ((p)+1)* 2*PGSIZE)
+
+// the CLINT's inter-processor interrupt bits, mapped again
+// beneath the kernel stacks, since the CLINT's own address is
+// user memory in a process's kernel page table.
+#define KCLINT KSTACK(NPROC)
+#define KCLINT_MSIP(hartid) (KCLINT + 4*(hartid))
 
 // User memory layout.
 // Address zero first:
@@ -62,6 +74,17 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   USERTOP (end of user memory)
+//   ...
+//   trapframes of threads NTHREAD-1 ... 1
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+
+// the threads of a process share a page table, so each
+// thread's trapframe has its own page, by slot number.
+#define THREADFRAME(slot) (TRAPFRAME - (slot)*PGSIZE)
+
+// a process's kernel page table maps its user memory
+// too, so user memory must end below the devices.
+#define USERTOP PLIC
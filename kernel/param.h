@@ -1,13 +1,17 @@
 #define NPROC        64  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
+#define NTHREAD       8  // maximum threads per process
+#define NPRIO         3  // number of scheduling priorities
+#define BOOSTTICKS   50  // ticks between priority boosts
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // most unreferenced i-nodes kept cached
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
+#define NSEG          4  // max lazily loaded program segments per process
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define MAXSG         8  // max blocks moved by one disk request
+#define FSSIZE       2000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
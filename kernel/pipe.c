@@ -8,17 +8,30 @@
 #include "sleeplock.h"
 #include "file.h"
 
-#define PIPESIZE 512
+// A pipe's data lives in a ring buffer of 2^PIPEORDER pages
+// from kalloc_order().
+#define PIPEORDER 2
+#define PIPESIZE (PGSIZE << PIPEORDER)
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *data;     // ring buffer of PIPESIZE bytes
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+  int reading;    // a read() is using the ring
+  int writing;    // a write() is using the ring
 };
 
+static struct kmem_cache *pipecache;
+
+void
+pipeinit(void)
+{
+  pipecache = kmem_cache_create("pipe", sizeof(struct pipe));
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,8 +41,15 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = kmem_cache_alloc(pipecache)) == 0)
     goto bad;
+  if((pi->data = kalloc_order(PIPEORDER)) == 0){
+    kmem_cache_free(pipecache, pi);
+    pi = 0;
+    goto bad;
+  }
+  pi->reading = 0;
+  pi->writing = 0;
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
@@ -46,8 +66,10 @@ pipealloc(struct file **f0, struct file **f1)
   return 0;
 
  bad:
-  if(pi)
-    kfree((char*)pi);
+  if(pi){
+    kfree_order(pi->data, PIPEORDER);
+    kmem_cache_free(pipecache, pi);
+  }
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -68,33 +90,84 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    freelock(&pi->lock);
+    kfree_order(pi->data, PIPEORDER);
+    kmem_cache_free(pipecache, pi);
   } else
     release(&pi->lock);
 }
 
+// read() and write() copy data directly between user space
+// and the ring, a whole contiguous stretch of the ring at a
+// time, but without holding pi->lock, since copyin() and
+// copyout() may have to read a page of the program file in,
+// which sleeps.  Meanwhile pi->writing keeps other writers
+// out, and pi->reading other readers, so that each write()
+// reaches the ring in one piece.  The stretch being copied
+// belongs to the one side that uses it: readers only look
+// below nwrite, and writers only above nread.
+
+// Wait until *busy is clear, then set it.
+// Returns -1 if the caller is killed meanwhile.
+// Caller must hold pi->lock.
+static int
+pipeclaim(struct pipe *pi, int *busy)
+{
+  while(*busy){
+    if(myproc()->killed)
+      return -1;
+    sleep(busy, &pi->lock);
+  }
+  *busy = 1;
+  return 0;
+}
+
+// Clear *busy, set by pipeclaim().
+// Caller must hold pi->lock.
+static void
+pipeunclaim(struct pipe *pi, int *busy)
+{
+  *busy = 0;
+  wakeup(busy);
+}
+
 int
 pipewrite(struct pipe *pi, uint64 addr, int n)
 {
-  int i;
-  char ch;
+  int i, m, r;
+  uint off;
   struct proc *pr = myproc();
 
   acquire(&pi->lock);
-  for(i = 0; i < n; i++){
+  if(pipeclaim(pi, &pi->writing) < 0){
+    release(&pi->lock);
+    return -1;
+  }
+  for(i = 0; i < n; i += m){
     while(pi->nwrite == pi->nread + PIPESIZE){  //DOC: pipewrite-full
       if(pi->readopen == 0 || pr->killed){
-        release(&pi->lock);
-        return -1;
+        i = -1;
+        goto out;
       }
       wakeup(&pi->nread);
       sleep(&pi->nwrite, &pi->lock);
     }
-    if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
+    off = pi->nwrite % PIPESIZE;
+    m = n - i;
+    if(m > PIPESIZE - off)
+      m = PIPESIZE - off;
+    if(m > pi->nread + PIPESIZE - pi->nwrite)
+      m = pi->nread + PIPESIZE - pi->nwrite;
+    release(&pi->lock);
+    r = copyin(pr->pagetable, pi->data + off, addr + i, m);
+    acquire(&pi->lock);
+    if(r == -1)
       break;
-    pi->data[pi->nwrite++ % PIPESIZE] = ch;
+    pi->nwrite += m;
+    wakeup(&pi->nread);
   }
-  wakeup(&pi->nread);
+ out:
+  pipeunclaim(pi, &pi->writing);
   release(&pi->lock);
   return i;
 }
@@ -102,26 +175,137 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
 int
 piperead(struct pipe *pi, uint64 addr, int n)
 {
-  int i;
+  int i, m, r;
+  uint off;
   struct proc *pr = myproc();
-  char ch;
 
   acquire(&pi->lock);
+  if(pipeclaim(pi, &pi->reading) < 0){
+    release(&pi->lock);
+    return -1;
+  }
   while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
     if(pr->killed){
-      release(&pi->lock);
-      return -1;
+      i = -1;
+      goto out;
     }
     sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(pi->nread == pi->nwrite)
+  for(i = 0; i < n && pi->nread != pi->nwrite; i += m){  //DOC: piperead-copy
+    off = pi->nread % PIPESIZE;
+    m = n - i;
+    if(m > PIPESIZE - off)
+      m = PIPESIZE - off;
+    if(m > pi->nwrite - pi->nread)
+      m = pi->nwrite - pi->nread;
+    release(&pi->lock);
+    r = copyout(pr->pagetable, addr + i, pi->data + off, m);
+    acquire(&pi->lock);
+    if(r == -1){
+      if(i == 0)
+        i = -1;
       break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+    }
+    pi->nread += m;
+    wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+  }
+ out:
+  pipeunclaim(pi, &pi->reading);
+  release(&pi->lock);
+  return i;
+}
+
+// Move up to n bytes from the inode of file f into pi,
+// reading them from the buffer cache straight into the
+// ring, as pipewrite() would copy them in from user space.
+// Stops early at the end of the file.
+int
+pipesplicein(struct pipe *pi, struct file *f, int n)
+{
+  int i, m, r;
+  uint off;
+  struct proc *pr = myproc();
+
+  acquire(&pi->lock);
+  if(pipeclaim(pi, &pi->writing) < 0){
+    release(&pi->lock);
+    return -1;
+  }
+  for(i = 0; i < n; i += r){
+    while(pi->nwrite == pi->nread + PIPESIZE){
+      if(pi->readopen == 0 || pr->killed){
+        i = -1;
+        goto out;
+      }
+      wakeup(&pi->nread);
+      sleep(&pi->nwrite, &pi->lock);
+    }
+    off = pi->nwrite % PIPESIZE;
+    m = n - i;
+    if(m > PIPESIZE - off)
+      m = PIPESIZE - off;
+    if(m > pi->nread + PIPESIZE - pi->nwrite)
+      m = pi->nread + PIPESIZE - pi->nwrite;
+    release(&pi->lock);
+    r = filereadi(f, 0, (uint64)(pi->data + off), m);
+    acquire(&pi->lock);
+    if(r < 0 && i == 0)
+      i = -1;
+    if(r <= 0)
+      break;
+    pi->nwrite += r;
+    wakeup(&pi->nread);
+    if(r < m)
+      break;  // end of file
+  }
+ out:
+  pipeunclaim(pi, &pi->writing);
+  release(&pi->lock);
+  return i;
+}
+
+// Move up to n bytes from pi to the inode of file f,
+// writing them from the ring straight into the buffer
+// cache, once there are any, as piperead() would.
+int
+pipespliceout(struct pipe *pi, struct file *f, int n)
+{
+  int i, m, r;
+  uint off;
+  struct proc *pr = myproc();
+
+  acquire(&pi->lock);
+  if(pipeclaim(pi, &pi->reading) < 0){
+    release(&pi->lock);
+    return -1;
+  }
+  while(pi->nread == pi->nwrite && pi->writeopen){
+    if(pr->killed){
+      i = -1;
+      goto out;
+    }
+    sleep(&pi->nread, &pi->lock);
+  }
+  for(i = 0; i < n && pi->nread != pi->nwrite; i += m){
+    off = pi->nread % PIPESIZE;
+    m = n - i;
+    if(m > PIPESIZE - off)
+      m = PIPESIZE - off;
+    if(m > pi->nwrite - pi->nread)
+      m = pi->nwrite - pi->nread;
+    release(&pi->lock);
+    r = filewritei(f, 0, (uint64)(pi->data + off), m);
+    acquire(&pi->lock);
+    if(r < 0){
+      if(i == 0)
+        i = -1;
       break;
+    }
+    pi->nread += m;
+    wakeup(&pi->nwrite);
   }
-  wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+ out:
+  pipeunclaim(pi, &pi->reading);
   release(&pi->lock);
   return i;
 }
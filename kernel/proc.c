@@ -10,13 +10,56 @@ struct cpu cpus[NCPU];
 
 struct proc proc[NPROC];
 
+// address spaces and open file tables, which the
+// threads of a process share.
+static struct vm vms[NPROC];
+static struct fdtable fdtables[NPROC];
+
 struct proc *initproc;
 
+// Per-CPU queues of RUNNABLE processes.  A process goes on
+// the queue of the CPU it last ran on, and an idle CPU steals
+// from the other queues.  Lock order: p->lock, then runq lock.
+//
+// Each CPU has one queue per priority (multi-level feedback
+// queue scheduling).  The scheduler runs the first process of
+// the highest non-empty priority.  A process that uses up its
+// quantum drops one priority; one that sleeps first keeps its
+// priority.  Every BOOSTTICKS ticks, boost() moves every
+// process back to the highest priority, so that long-running
+// processes can't starve.
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NPRIO];
+  struct proc *tail[NPRIO];
+} runq[NCPU];
+
+// ticks a process may run at priority pri before being demoted.
+#define QUANTUM(pri) (1 << (pri))
+
+// Sleeping processes, hashed by wait channel, so that wakeup()
+// only looks at processes sleeping on channels in one bucket.
+// A process is on a wait queue exactly when it is SLEEPING.
+// Lock order: sleep()'s lk, then wait queue lock, then p->lock.
+#define NWAITQ 61
+#define WAITQ(chan) (&waitq[((uint64)(chan) >> 3) % NWAITQ])
+
+struct waitq {
+  struct spinlock lock;
+  struct proc *head;
+} waitq[NWAITQ];
+
+// helps ensure that wakeups of wait()ing
+// parents are not lost. helps obey the
+// memory model when using p->parent.
+// must be acquired before any p->lock.
+struct spinlock wait_lock;
+
 int nextpid = 1;
 struct spinlock pid_lock;
 
 extern void forkret(void);
-static void wakeup1(struct proc *chan);
+static void kprocret(void);
 static void freeproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
@@ -28,6 +71,15 @@ procinit(void)
   struct proc *p;
   
   initlock(&pid_lock, "nextpid");
+  initlock(&wait_lock, "wait_lock");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
+  for(int i = 0; i < NWAITQ; i++)
+    initlock(&waitq[i].lock, "waitq");
+  for(int i = 0; i < NPROC; i++){
+    initlock(&vms[i].lock, "vm");
+    initlock(&fdtables[i].lock, "fdtable");
+  }
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
 
@@ -44,6 +96,97 @@ procinit(void)
   kvminithart();
 }
 
+// Mark p RUNNABLE and append it to its CPU's run queue
+// for its priority.
+// Caller must hold p->lock.
+static void
+makerunnable(struct proc *p)
+{
+  struct runq *rq = &runq[p->cpu];
+  int pri = p->priority;
+
+  p->state = RUNNABLE;
+  acquire(&rq->lock);
+  p->rqnext = 0;
+  p->onrq = 1;
+  if(rq->tail[pri])
+    rq->tail[pri]->rqnext = p;
+  else
+    rq->head[pri] = p;
+  rq->tail[pri] = p;
+  release(&rq->lock);
+}
+
+// Remove the RUNNABLE process p from its run queue.
+// Returns 0 if p is on none, because a scheduler has
+// taken it off but not yet run it.
+// Caller must hold p->lock.
+static int
+runqremove(struct proc *p)
+{
+  struct runq *rq = &runq[p->cpu];
+  int pri = p->priority;
+  struct proc **pp, *prev;
+
+  acquire(&rq->lock);
+  if(!p->onrq){
+    release(&rq->lock);
+    return 0;
+  }
+  prev = 0;
+  for(pp = &rq->head[pri]; *pp != p; pp = &(*pp)->rqnext){
+    if(*pp == 0)
+      panic("runqremove");
+    prev = *pp;
+  }
+  *pp = p->rqnext;
+  if(rq->tail[pri] == p)
+    rq->tail[pri] = prev;
+  p->rqnext = 0;
+  p->onrq = 0;
+  release(&rq->lock);
+  return 1;
+}
+
+// Remove and return the first process of the highest
+// non-empty priority in rq, or 0.
+static struct proc*
+runqpop(struct runq *rq)
+{
+  struct proc *p = 0;
+
+  acquire(&rq->lock);
+  for(int pri = 0; pri < NPRIO && p == 0; pri++){
+    p = rq->head[pri];
+    if(p){
+      rq->head[pri] = p->rqnext;
+      if(rq->head[pri] == 0)
+        rq->tail[pri] = 0;
+      p->rqnext = 0;
+      p->onrq = 0;
+    }
+  }
+  release(&rq->lock);
+  return p;
+}
+
+// Set p's priority and start a new quantum, moving p
+// to the right queue if it is on one.  A RUNNABLE p that a
+// scheduler has already taken off its queue is about to run,
+// and the new priority applies when it is next queued.
+// Caller must hold p->lock.
+static void
+setprio(struct proc *p, int pri)
+{
+  if(p->state == RUNNABLE && p->priority != pri && runqremove(p)){
+    p->priority = pri;
+    makerunnable(p);
+  } else {
+    p->priority = pri;
+  }
+  p->slice = 0;
+}
+
 // Must be called with interrupts disabled,
 // to prevent race with process being moved
 // to a different CPU.
@@ -106,6 +249,8 @@ allocproc(void)
 
 found:
   p->pid = allocpid();
+  p->priority = 0;
+  p->slice = 0;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -113,14 +258,6 @@ found:
     return 0;
   }
 
-  // An empty user page table.
-  p->pagetable = proc_pagetable(p);
-  if(p->pagetable == 0){
-    freeproc(p);
-    release(&p->lock);
-    return 0;
-  }
-
   // Set up new context to start executing at forkret,
   // which returns to user space.
   memset(&p->context, 0, sizeof(p->context));
@@ -130,25 +267,158 @@ found:
   return p;
 }
 
+// Give p a new address space, with no user memory.
+// Returns 0, or -1 if out of memory.
+static int
+allocvm(struct proc *p)
+{
+  struct vm *vm;
+
+  for(vm = vms; vm < &vms[NPROC]; vm++){
+    acquire(&vm->lock);
+    if(vm->ref == 0)
+      goto found;
+    release(&vm->lock);
+  }
+  return -1;
+
+found:
+  p->tslot = 0;
+  if((vm->pagetable = proc_pagetable(p)) == 0){
+    release(&vm->lock);
+    return -1;
+  }
+  if((vm->kpagetable = ukvmcreate(vm->pagetable)) == 0){
+    proc_freepagetable(vm->pagetable, 0, 0);
+    release(&vm->lock);
+    return -1;
+  }
+  vm->ref = 1;
+  vm->slots = 1;
+  vm->stale = 0;
+  vm->asid = 0;
+  vm->sz = 0;
+  vm->guard = 0;
+  vm->exec = 0;
+  memset(vm->segs, 0, sizeof(vm->segs));
+  release(&vm->lock);
+  p->vm = vm;
+  p->pagetable = vm->pagetable;
+  return 0;
+}
+
+// Drop p's use of its address space.  The last thread
+// to go frees the user memory and the page table.
+// Puts the program file then, so the caller must be in a
+// transaction unless the address space has none.
+static void
+vmput(struct proc *p)
+{
+  struct vm *vm = p->vm;
+  struct inode *ip;
+
+  p->vm = 0;
+  p->pagetable = 0;
+  // stop using vm's kernel page table, which may be about to
+  // go; the scheduler won't switch back to it now.
+  if(p == myproc())
+    kvmswitch();
+  acquire(&vm->lock);
+  uvmunmap(vm->pagetable, THREADFRAME(p->tslot), 1, 0);
+  vm->slots &= ~(1 << p->tslot);
+  if(vm->ref > 1){
+    // the slot may go to a new thread.
+    uvmflush(vm);
+    vm->ref--;
+    release(&vm->lock);
+    return;
+  }
+  proc_freepagetable(vm->pagetable, vm->kpagetable, vm->sz);
+  vm->pagetable = 0;
+  vm->kpagetable = 0;
+  vm->sz = 0;
+  vm->guard = 0;
+  ip = vm->exec;
+  vm->exec = 0;
+  vm->ref = 0;
+  release(&vm->lock);
+  if(ip)
+    iput(ip);
+}
+
+// Give p a new, empty open file table.
+// Returns 0, or -1 if there are none left.
+static int
+allocfdt(struct proc *p)
+{
+  struct fdtable *fdt;
+
+  for(fdt = fdtables; fdt < &fdtables[NPROC]; fdt++){
+    acquire(&fdt->lock);
+    if(fdt->ref == 0){
+      fdt->ref = 1;
+      memset(fdt->ofile, 0, sizeof(fdt->ofile));
+      release(&fdt->lock);
+      p->fdt = fdt;
+      return 0;
+    }
+    release(&fdt->lock);
+  }
+  return -1;
+}
+
+// Drop p's use of its open file table.
+// The last thread to go closes the files.
+static void
+fdtput(struct proc *p)
+{
+  struct fdtable *fdt = p->fdt;
+
+  p->fdt = 0;
+  acquire(&fdt->lock);
+  if(fdt->ref > 1){
+    fdt->ref--;
+    release(&fdt->lock);
+    return;
+  }
+  release(&fdt->lock);
+
+  // no other thread can open or close files now,
+  // and ref stays 1 until we are done.
+  for(int fd = 0; fd < NOFILE; fd++){
+    if(fdt->ofile[fd]){
+      fileclose(fdt->ofile[fd]);
+      fdt->ofile[fd] = 0;
+    }
+  }
+  acquire(&fdt->lock);
+  fdt->ref = 0;
+  release(&fdt->lock);
+}
+
 // free a proc structure and the data hanging from it,
 // including user pages.
-// p->lock must be held.
+// p->lock must be held, so p's address space and files
+// must not be the last users of any file or inode.
 static void
 freeproc(struct proc *p)
 {
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
-  if(p->pagetable)
-    proc_freepagetable(p->pagetable, p->sz);
-  p->pagetable = 0;
-  p->sz = 0;
+  if(p->vm)
+    vmput(p);
+  if(p->fdt)
+    fdtput(p);
+  p->tslot = 0;
   p->pid = 0;
   p->parent = 0;
+  p->thread = 0;
   p->name[0] = 0;
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->kfn = 0;
   p->state = UNUSED;
 }
 
@@ -175,6 +445,7 @@ proc_pagetable(struct proc *p)
   }
 
   // map the trapframe just below TRAMPOLINE, for trampoline.S.
+  // a new page table always starts with a single thread.
   if(mappages(pagetable, TRAPFRAME, PGSIZE,
               (uint64)(p->trapframe), PTE_R | PTE_W) < 0){
     uvmunmap(pagetable, TRAMPOLINE, 1, 0);
@@ -186,10 +457,13 @@ proc_pagetable(struct proc *p)
 }
 
 // Free a process's page table, and free the
-// physical memory it refers to.
+// physical memory it refers to, along with its
+// kernel page table, if it has one yet.
 void
-proc_freepagetable(pagetable_t pagetable, uint64 sz)
+proc_freepagetable(pagetable_t pagetable, pagetable_t kpagetable, uint64 sz)
 {
+  if(kpagetable)
+    ukvmfree(kpagetable, pagetable);
   uvmunmap(pagetable, TRAMPOLINE, 1, 0);
   uvmunmap(pagetable, TRAPFRAME, 1, 0);
   uvmfree(pagetable, sz);
@@ -214,12 +488,14 @@ userinit(void)
   struct proc *p;
 
   p = allocproc();
+  if(p == 0 || allocvm(p) < 0 || allocfdt(p) < 0)
+    panic("userinit");
   initproc = p;
   
   // allocate one user page and copy init's instructions
   // and data into it.
   uvminit(p->pagetable, initcode, sizeof(initcode));
-  p->sz = PGSIZE;
+  p->vm->sz = PGSIZE;
 
   // prepare for the very first "return" from kernel to user.
   p->trapframe->epc = 0;      // user program counter
@@ -228,12 +504,43 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  makerunnable(p);
+
+  release(&p->lock);
+}
+
+// Start a kernel process that runs fn(), which must never
+// return.  It has no user memory, no files, no parent and no cwd,
+// so fn() must not exit() or use paths relative to cwd.
+void
+kproc(char *name, void (*fn)(void))
+{
+  struct proc *p;
 
+  if((p = allocproc()) == 0)
+    panic("kproc");
+  p->context.ra = (uint64)kprocret;
+  p->kfn = fn;
+  safestrcpy(p->name, name, sizeof(p->name));
+  makerunnable(p);
   release(&p->lock);
 }
 
+// A kernel process's very first scheduling by scheduler()
+// will swtch to kprocret.
+static void
+kprocret(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+  p->kfn();
+  panic("kproc returned");
+}
+
 // Grow or shrink user memory by n bytes.
+// Caller must hold p->vm->lock.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
@@ -241,15 +548,19 @@ growproc(int n)
   uint sz;
   struct proc *p = myproc();
 
-  sz = p->sz;
+  sz = p->vm->sz;
   if(n > 0){
     if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
       return -1;
     }
   } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+    if(uvmshrink(p->vm, sz, sz + n) != sz + n)
+      return -1;
+    sz = sz + n;
+    if(sz <= p->vm->guard)
+      p->vm->guard = 0;
   }
-  p->sz = sz;
+  p->vm->sz = sz;
   return 0;
 }
 
@@ -266,16 +577,27 @@ fork(void)
   if((np = allocproc()) == 0){
     return -1;
   }
-
-  // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  if(allocvm(np) < 0 || allocfdt(np) < 0){
     freeproc(np);
     release(&np->lock);
     return -1;
   }
-  np->sz = p->sz;
 
-  np->parent = p;
+  // Copy user memory from parent to child.  Only the calling
+  // thread is copied; the lock keeps the parent's other
+  // threads from changing the page table meanwhile.
+  acquire(&p->vm->lock);
+  if(uvmcopy(p->pagetable, np->pagetable, p->vm->sz) < 0){
+    release(&p->vm->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  np->vm->sz = p->vm->sz;
+  np->vm->guard = p->vm->guard;
+  // the parent's writable pages are now copy-on-write.
+  uvmflush(p->vm);
+  release(&p->vm->lock);
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -284,44 +606,122 @@ fork(void)
   np->trapframe->a0 = 0;
 
   // increment reference counts on open file descriptors.
+  acquire(&p->fdt->lock);
   for(i = 0; i < NOFILE; i++)
-    if(p->ofile[i])
-      np->ofile[i] = filedup(p->ofile[i]);
+    if(p->fdt->ofile[i])
+      np->fdt->ofile[i] = filedup(p->fdt->ofile[i]);
+  release(&p->fdt->lock);
   np->cwd = idup(p->cwd);
+  if(p->vm->exec)
+    np->vm->exec = idup(p->vm->exec);
+  memmove(np->vm->segs, p->vm->segs, sizeof(p->vm->segs));
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
   pid = np->pid;
 
-  np->state = RUNNABLE;
+  release(&np->lock);
+
+  acquire(&wait_lock);
+  np->parent = p;
+  release(&wait_lock);
 
+  acquire(&np->lock);
+  // start on this CPU's queue; idle CPUs will steal it.
+  np->cpu = cpuid();
+  makerunnable(np);
   release(&np->lock);
 
   return pid;
 }
 
+// Create a new thread in the current process, which starts
+// running fn(arg) in user space, with its stack pointer at
+// stack.  The thread shares the caller's memory and open
+// files; it has a trapframe of its own, mapped in the shared
+// page table at the lowest free THREADFRAME slot.
+// uvmflush() makes the other harts running the process's
+// threads drop PTEs that fork() or sbrk() change.
+// Returns the new thread's id, which is a pid, or -1.
+int
+clone(uint64 fn, uint64 arg, uint64 stack)
+{
+  int slot, tid;
+  struct proc *np;
+  struct proc *p = myproc();
+  struct vm *vm = p->vm;
+
+  if((np = allocproc()) == 0)
+    return -1;
+
+  acquire(&vm->lock);
+  for(slot = 0; slot < NTHREAD; slot++)
+    if((vm->slots & (1 << slot)) == 0)
+      break;
+  if(slot == NTHREAD ||
+     mappages(vm->pagetable, THREADFRAME(slot), PGSIZE,
+              (uint64)np->trapframe, PTE_R | PTE_W) < 0){
+    release(&vm->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  vm->slots |= 1 << slot;
+  vm->ref++;
+  release(&vm->lock);
+  np->vm = vm;
+  np->pagetable = vm->pagetable;
+  np->tslot = slot;
+
+  acquire(&p->fdt->lock);
+  p->fdt->ref++;
+  release(&p->fdt->lock);
+  np->fdt = p->fdt;
+  np->cwd = idup(p->cwd);
+
+  // start at fn(arg).  fn must exit() the thread itself, as
+  // user/thread.c's start() does; if it returns, it jumps to
+  // MAXVA, an address no user page can have, and the
+  // instruction page fault kills the thread.
+  *(np->trapframe) = *(p->trapframe);
+  np->trapframe->epc = fn;
+  np->trapframe->a0 = arg;
+  np->trapframe->sp = stack;
+  np->trapframe->ra = MAXVA;
+
+  safestrcpy(np->name, p->name, sizeof(p->name));
+
+  tid = np->pid;
+
+  release(&np->lock);
+
+  acquire(&wait_lock);
+  np->parent = p;
+  np->thread = 1;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  np->cpu = cpuid();
+  makerunnable(np);
+  release(&np->lock);
+
+  return tid;
+}
+
 // Pass p's abandoned children to init.
-// Caller must hold p->lock.
+// Threads among them become ordinary children,
+// so that init's wait() reaps them.
+// Caller must hold wait_lock.
 void
 reparent(struct proc *p)
 {
   struct proc *pp;
 
   for(pp = proc; pp < &proc[NPROC]; pp++){
-    // this code uses pp->parent without holding pp->lock.
-    // acquiring the lock first could cause a deadlock
-    // if pp or a child of pp were also in exit()
-    // and about to try to lock p.
     if(pp->parent == p){
-      // pp->parent can't change between the check and the acquire()
-      // because only the parent changes it, and we're the parent.
-      acquire(&pp->lock);
       pp->parent = initproc;
-      // we should wake up init here, but that would require
-      // initproc->lock, which would be a deadlock, since we hold
-      // the lock on one of init's children (pp). this is why
-      // exit() always wakes init (before acquiring any locks).
-      release(&pp->lock);
+      pp->thread = 0;
+      wakeup(initproc);
     }
   }
 }
@@ -337,98 +737,84 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
-  // Close all open files.
-  for(int fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd]){
-      struct file *f = p->ofile[fd];
-      fileclose(f);
-      p->ofile[fd] = 0;
-    }
+  // The process's first thread exiting ends the process:
+  // the other threads exit when they next leave the kernel.
+  if(p->tslot == 0){
+    for(struct proc *pp = proc; pp < &proc[NPROC]; pp++)
+      if(pp != p && pp->vm == p->vm)
+        kill(pp->pid);
   }
 
+  // Close all open files, unless other threads use them.
+  fdtput(p);
+
   begin_op();
   iput(p->cwd);
+  vmput(p);
   end_op();
   p->cwd = 0;
 
-  // we might re-parent a child to init. we can't be precise about
-  // waking up init, since we can't acquire its lock once we've
-  // acquired any other proc lock. so wake up init whether that's
-  // necessary or not. init may miss this wakeup, but that seems
-  // harmless.
-  acquire(&initproc->lock);
-  wakeup1(initproc);
-  release(&initproc->lock);
-
-  // grab a copy of p->parent, to ensure that we unlock the same
-  // parent we locked. in case our parent gives us away to init while
-  // we're waiting for the parent lock. we may then race with an
-  // exiting parent, but the result will be a harmless spurious wakeup
-  // to a dead or wrong process; proc structs are never re-allocated
-  // as anything else.
-  acquire(&p->lock);
-  struct proc *original_parent = p->parent;
-  release(&p->lock);
-  
-  // we need the parent's lock in order to wake it up from wait().
-  // the parent-then-child rule says we have to lock it first.
-  acquire(&original_parent->lock);
-
-  acquire(&p->lock);
+  acquire(&wait_lock);
 
   // Give any children to init.
   reparent(p);
 
   // Parent might be sleeping in wait().
-  wakeup1(original_parent);
+  wakeup(p->parent);
+  
+  acquire(&p->lock);
 
   p->xstate = status;
   p->state = ZOMBIE;
 
-  release(&original_parent->lock);
+  release(&wait_lock);
 
   // Jump into the scheduler, never to return.
   sched();
   panic("zombie exit");
 }
 
-// Wait for a child process to exit and return its pid.
-// Return -1 if this process has no children.
-int
-wait(uint64 addr)
+// Wait for a child of the current process to exit, free it,
+// copy its exit status to addr if that is not 0, and return
+// its pid.  Only considers threads if thread is set, else
+// only processes, and only the one with the given pid if
+// pid is not 0.  Return -1 if there is no such child.
+static int
+reap(uint64 addr, int thread, int pid0)
 {
   struct proc *np;
-  int havekids, pid;
+  int havekids, pid, xstate;
   struct proc *p = myproc();
 
-  // hold p->lock for the whole time to avoid lost
-  // wakeups from a child's exit().
-  acquire(&p->lock);
+  acquire(&wait_lock);
 
   for(;;){
     // Scan through table looking for exited children.
     havekids = 0;
     for(np = proc; np < &proc[NPROC]; np++){
-      // this code uses np->parent without holding np->lock.
-      // acquiring the lock first would cause a deadlock,
-      // since np might be an ancestor, and we already hold p->lock.
-      if(np->parent == p){
-        // np->parent can't change between the check and the acquire()
-        // because only the parent changes it, and we're the parent.
+      if(np->parent == p && np->thread == thread &&
+         (pid0 == 0 || np->pid == pid0)){
+        // make sure the child isn't still in exit() or swtch().
         acquire(&np->lock);
+
         havekids = 1;
         if(np->state == ZOMBIE){
           // Found one.
           pid = np->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
-                                  sizeof(np->xstate)) < 0) {
-            release(&np->lock);
-            release(&p->lock);
+          xstate = np->xstate;
+          release(&np->lock);
+          release(&wait_lock);
+          // copy out without holding locks, since copyout()
+          // may have to read a page of the program file in.
+          // np stays a zombie meanwhile; only we can free it.
+          if(addr != 0 && copyout(p->pagetable, addr, (char *)&xstate,
+                                  sizeof(xstate)) < 0)
             return -1;
-          }
+          acquire(&wait_lock);
+          acquire(&np->lock);
           freeproc(np);
           release(&np->lock);
-          release(&p->lock);
+          release(&wait_lock);
           return pid;
         }
         release(&np->lock);
@@ -437,15 +823,32 @@ wait(uint64 addr)
 
     // No point waiting if we don't have any children.
     if(!havekids || p->killed){
-      release(&p->lock);
+      release(&wait_lock);
       return -1;
     }
     
     // Wait for a child to exit.
-    sleep(p, &p->lock);  //DOC: wait-sleep
+    sleep(p, &wait_lock);  //DOC: wait-sleep
   }
 }
 
+// Wait for a child process to exit and return its pid.
+// Return -1 if this process has no children.
+int
+wait(uint64 addr)
+{
+  return reap(addr, 0, 0);
+}
+
+// Wait for thread tid, which the current thread created
+// with clone(), to exit, or for any such thread if tid is 0.
+// Return its id, or -1 if there is no such thread.
+int
+join(int tid, uint64 addr)
+{
+  return reap(addr, 1, tid);
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
@@ -458,35 +861,51 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = cpuid();
   
   c->proc = 0;
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
-    
-    int found = 0;
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-
-        found = 1;
-      }
-      release(&p->lock);
-    }
-    if(found == 0) {
+
+    // Take the first process on this CPU's queue,
+    // or else steal one from another CPU's.
+    p = runqpop(&runq[id]);
+    for(int i = 1; p == 0 && i < NCPU; i++)
+      p = runqpop(&runq[(id + i) % NCPU]);
+    if(p == 0) {
       intr_on();
       asm volatile("wfi");
+      continue;
     }
+
+    // p is now off every queue, and only a scheduler takes a
+    // RUNNABLE process off a queue for good (setprio() puts it
+    // straight back), so p is ours.  p->lock may
+    // still be held by the CPU that queued p, until that CPU
+    // has switched away from it.
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler");
+
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    p->cpu = id;
+    c->proc = p;
+    // run in p's kernel page table, which maps its user
+    // memory too; kernel processes have none.
+    if(p->vm)
+      uvmswitch(p->vm);
+    swtch(&c->context, &p->context);
+    kvmswitch();
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+
+    release(&p->lock);
   }
 }
 
@@ -517,13 +936,87 @@ sched(void)
   mycpu()->intena = intena;
 }
 
+// Charge a clock tick to the current process.  Called from
+// the timer interrupt.  Gives up the CPU if the process has
+// used up its quantum, after moving it down a priority, or if
+// a higher-priority process is waiting on this CPU.
+void
+timeslice(void)
+{
+  struct proc *p = myproc();
+  struct runq *rq;
+  int pri, preempt;
+
+  acquire(&p->lock);
+  if(++p->slice >= QUANTUM(p->priority)){
+    if(p->priority < NPRIO-1)
+      p->priority++;
+    p->slice = 0;
+    preempt = 1;
+  } else {
+    // a peek without rq->lock is good enough.
+    rq = &runq[cpuid()];
+    preempt = 0;
+    for(pri = 0; pri < p->priority; pri++)
+      if(rq->head[pri])
+        preempt = 1;
+  }
+  release(&p->lock);
+
+  if(preempt)
+    yield();
+}
+
+// Move every process to the highest priority.
+// Called every BOOSTTICKS ticks by the timer interrupt.
+void
+boost(void)
+{
+  struct proc *p;
+
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->state != UNUSED)
+      setprio(p, 0);
+    release(&p->lock);
+  }
+}
+
+// Set the scheduling priority of the process with the given
+// pid (0 means the caller).  A priority below 0 just queries.
+// Returns the old priority, or -1.  The process keeps the new
+// priority until it uses up a quantum or the next boost.
+int
+setpriority(int pid, int pri)
+{
+  struct proc *p;
+  int old;
+
+  if(pri >= NPRIO)
+    return -1;
+  if(pid == 0)
+    pid = myproc()->pid;
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED){
+      old = p->priority;
+      if(pri >= 0)
+        setprio(p, pri);
+      release(&p->lock);
+      return old;
+    }
+    release(&p->lock);
+  }
+  return -1;
+}
+
 // Give up the CPU for one scheduling round.
 void
 yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  makerunnable(p);
   sched();
   release(&p->lock);
 }
@@ -555,21 +1048,24 @@ void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct waitq *wq = WAITQ(chan);
   
-  // Must acquire p->lock in order to
-  // change p->state and then call sched.
-  // Once we hold p->lock, we can be
+  // Once we hold the wait queue's lock, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // (wakeup locks the wait queue),
   // so it's okay to release lk.
-  if(lk != &p->lock){  //DOC: sleeplock0
-    acquire(&p->lock);  //DOC: sleeplock1
-    release(lk);
-  }
+  // Must acquire p->lock in order to
+  // change p->state and then call sched.
+  acquire(&wq->lock);  //DOC: sleeplock1
+  acquire(&p->lock);
+  release(lk);
 
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  p->wqnext = wq->head;
+  wq->head = p;
+  release(&wq->lock);
 
   sched();
 
@@ -577,10 +1073,8 @@ sleep(void *chan, struct spinlock *lk)
   p->chan = 0;
 
   // Reacquire original lock.
-  if(lk != &p->lock){
-    release(&p->lock);
-    acquire(lk);
-  }
+  release(&p->lock);
+  acquire(lk);
 }
 
 // Wake up all processes sleeping on chan.
@@ -588,27 +1082,43 @@ sleep(void *chan, struct spinlock *lk)
 void
 wakeup(void *chan)
 {
-  struct proc *p;
-
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == SLEEPING && p->chan == chan) {
-      p->state = RUNNABLE;
+  struct waitq *wq = WAITQ(chan);
+  struct proc *p, **pp;
+
+  acquire(&wq->lock);
+  for(pp = &wq->head; (p = *pp) != 0; ){
+    if(p->chan == chan){
+      *pp = p->wqnext;
+      // p may still be switching away in sched();
+      // p->lock is held until it is done.
+      acquire(&p->lock);
+      makerunnable(p);
+      release(&p->lock);
+    } else {
+      pp = &p->wqnext;
     }
-    release(&p->lock);
   }
+  release(&wq->lock);
 }
 
-// Wake up p if it is sleeping in wait(); used by exit().
-// Caller must hold p->lock.
+// Wake up p if it is still sleeping on chan.
 static void
-wakeup1(struct proc *p)
+wakeproc(struct proc *p, void *chan)
 {
-  if(!holding(&p->lock))
-    panic("wakeup1");
-  if(p->chan == p && p->state == SLEEPING) {
-    p->state = RUNNABLE;
+  struct waitq *wq = WAITQ(chan);
+  struct proc **pp;
+
+  acquire(&wq->lock);
+  for(pp = &wq->head; *pp != 0; pp = &(*pp)->wqnext){
+    if(*pp == p){
+      *pp = p->wqnext;
+      acquire(&p->lock);
+      makerunnable(p);
+      release(&p->lock);
+      break;
+    }
   }
+  release(&wq->lock);
 }
 
 // Kill the process with the given pid.
@@ -618,16 +1128,19 @@ int
 kill(int pid)
 {
   struct proc *p;
+  void *chan;
 
   for(p = proc; p < &proc[NPROC]; p++){
     acquire(&p->lock);
     if(p->pid == pid){
       p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
+      chan = p->state == SLEEPING ? p->chan : 0;
       release(&p->lock);
+      // Wake process from sleep().  The wait queue lock
+      // comes before p->lock, so p may wake up (and even
+      // sleep again) in between; wakeproc() checks.
+      if(chan)
+        wakeproc(p, chan);
       return 0;
     }
     release(&p->lock);
@@ -689,7 +1202,7 @@ procdump(void)
       state = states[p->state];
     else
       state = "???";
-    printf("%d %s %s", p->pid, state, p->name);
+    printf("%d %s %s pri %d", p->pid, state, p->name, p->priority);
     printf("\n");
   }
 }
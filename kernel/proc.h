@@ -21,6 +21,10 @@ struct context {
 // Per-CPU state.
 struct cpu {
   struct proc *proc;          // The process running on this cpu, or null.
+  struct vm *vm;              // Address space satp is set to, or null.
+  uint64 asidgen;             // ASID generation the TLB was flushed for.
+  uint64 tlbreq;              // TLB flushes other harts have asked for,
+  uint64 tlbdone;             // and how many of them this hart has done.
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
@@ -82,25 +86,73 @@ struct trapframe {
 
 enum procstate { UNUSED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
-// Per-process state
+// A program segment that exec() maps without reading it.
+// Each page is read from the program file (vm->exec) the
+// first time the process touches it; see loadpage().
+struct seg {
+  uint64 va;      // page-aligned start address
+  uint64 filesz;  // bytes of file content starting at va; 0 if unused
+  uint off;       // file offset of va
+};
+
+// A user address space, shared by all the threads of a process.
+struct vm {
+  struct spinlock lock;        // Serializes changes to sz and the page table
+  int ref;                     // Number of threads using it; 0 if free
+  uint slots;                  // Bitmap of trapframe slots in use
+  uint stale;                  // Bitmap of harts that must flush asid first
+  uint64 asid;                 // ASID generation and number, see uvmswitch()
+  uint64 sz;                   // Size of process memory (bytes)
+  uint64 guard;                // User stack guard page, or 0
+  pagetable_t pagetable;       // User page table
+  pagetable_t kpagetable;      // Kernel page table, see ukvmcreate()
+  struct inode *exec;          // Program file, for lazily loaded segments
+  struct seg segs[NSEG];       // Lazily loaded program segments
+};
+
+// The open files of a process, shared by all its threads.
+struct fdtable {
+  struct spinlock lock;        // Protects ref and allocating descriptors
+  int ref;                     // Number of threads using it; 0 if free
+  struct file *ofile[NOFILE];  // Open files
+};
+
+// Per-process state.  A thread is a process that
+// shares its creator's vm and fdtable; see clone().
 struct proc {
   struct spinlock lock;
 
   // p->lock must be held when using these:
   enum procstate state;        // Process state
-  struct proc *parent;         // Parent process
   void *chan;                  // If non-zero, sleeping on chan
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int cpu;                     // CPU whose run queue p goes on
+  int priority;                // Scheduling priority, 0 is highest
+  int slice;                   // Ticks used of the current quantum
+
+  // the run queue's lock must be held when using these:
+  struct proc *rqnext;         // Next process on the run queue
+  int onrq;                    // If non-zero, on runq[cpu]
+
+  // the wait queue's lock must be held when using this:
+  struct proc *wqnext;         // Next process sleeping in the same wait queue
+
+  // wait_lock must be held when using these:
+  struct proc *parent;         // Parent process
+  int thread;                  // If non-zero, reaped by join() rather than wait()
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
-  uint64 sz;                   // Size of process memory (bytes)
-  pagetable_t pagetable;       // User page table
+  struct vm *vm;               // User memory
+  pagetable_t pagetable;       // User page table, the same as vm->pagetable
+  int tslot;                   // trapframe is mapped at THREADFRAME(tslot)
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
-  struct file *ofile[NOFILE];  // Open files
+  struct fdtable *fdt;         // Open files
+  int nsleep;                  // Number of sleep locks held
   struct inode *cwd;           // Current directory
+  void (*kfn)(void);           // Body of a kernel process, see kproc()
   char name[16];               // Process name (debugging)
 };
@@ -0,0 +1,218 @@
+// Slab allocator, for small kernel objects such as
+// pipes, open files, and in-memory inodes.
+//
+// A kmem_cache hands out objects of one size.  It carves pages
+// from kalloc() into slabs: each slab page starts with a struct
+// slab and holds as many objects as fit after it, so that
+// kmem_cache_free() finds an object's slab by rounding its
+// address down to a page.  Slabs with free objects are kept
+// on a list; a slab whose objects are all free goes back to
+// kfree(), so the number of objects is limited only by memory.
+//
+// As with kalloc(), each CPU has a small cache of free objects
+// in front of the slabs, protected by its own lock, so that
+// allocating and freeing objects on different CPUs rarely
+// contends for the kmem_cache's lock.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define NKMCACHE  8   // maximum number of kmem_caches
+#define NOBJCACHE 16  // most objects in a CPU's cache
+#define NOBJBATCH 8   // objects moved between a CPU's cache and the slabs at once
+
+// a free object.
+struct obj {
+  struct obj *next;
+};
+
+// the header at the start of each slab page.
+struct slab {
+  struct kmem_cache *cache;
+  struct slab *next;  // list of slabs with free objects
+  struct slab *prev;
+  struct obj *free;   // this slab's free objects
+  int inuse;          // objects not on free
+};
+
+struct kmem_cache {
+  struct spinlock lock;
+  char *name;
+  uint size;          // object size, a multiple of 8
+  int perslab;        // objects in each slab
+  struct slab partial; // head of list of slabs with free objects
+  int nslab;          // number of slabs
+  int nobj;           // objects taken from slabs
+
+  struct {
+    struct spinlock lock;
+    void *obj[NOBJCACHE];
+    int n;
+  } cpu[NCPU];
+};
+
+static struct kmem_cache kmcaches[NKMCACHE];
+static int nkmcache;
+
+// Create a cache of objects of size bytes.
+// only used when booting.
+struct kmem_cache*
+kmem_cache_create(char *name, uint size)
+{
+  struct kmem_cache *c;
+
+  size = (size + 7) & ~7;
+  if(nkmcache >= NKMCACHE || size > PGSIZE - sizeof(struct slab))
+    panic("kmem_cache_create");
+  c = &kmcaches[nkmcache++];
+  initlock(&c->lock, "slab");
+  c->name = name;
+  c->size = size;
+  c->perslab = (PGSIZE - sizeof(struct slab)) / size;
+  c->partial.next = c->partial.prev = &c->partial;
+  for(int i = 0; i < NCPU; i++)
+    initlock(&c->cpu[i].lock, "slab");
+  return c;
+}
+
+// Take an object from one of c's slabs, allocating
+// a new slab if none has a free object.
+// Returns 0 if out of memory.
+// Caller must hold c->lock.
+static void*
+slaballoc(struct kmem_cache *c)
+{
+  struct slab *s;
+  struct obj *o;
+
+  s = c->partial.next;
+  if(s == &c->partial){
+    if((s = (struct slab*)kalloc()) == 0)
+      return 0;
+    s->cache = c;
+    s->free = 0;
+    s->inuse = 0;
+    for(int i = c->perslab - 1; i >= 0; i--){
+      o = (struct obj*)((char*)(s + 1) + i*c->size);
+      o->next = s->free;
+      s->free = o;
+    }
+    s->next = c->partial.next;
+    s->prev = &c->partial;
+    s->next->prev = s;
+    c->partial.next = s;
+    c->nslab++;
+  }
+
+  o = s->free;
+  s->free = o->next;
+  s->inuse++;
+  if(s->free == 0){
+    // full: take it off the list.
+    s->prev->next = s->next;
+    s->next->prev = s->prev;
+  }
+  c->nobj++;
+  return o;
+}
+
+// Return object o to its slab, and free the slab
+// if none of its objects is in use.
+// Caller must hold c->lock.
+static void
+slabfree(struct kmem_cache *c, void *o)
+{
+  struct slab *s = (struct slab*)PGROUNDDOWN((uint64)o);
+
+  if(s->cache != c)
+    panic("kmem_cache_free");
+  if(s->free == 0){
+    // was full: put it back on the list.
+    s->next = c->partial.next;
+    s->prev = &c->partial;
+    s->next->prev = s;
+    c->partial.next = s;
+  }
+  ((struct obj*)o)->next = s->free;
+  s->free = o;
+  s->inuse--;
+  c->nobj--;
+  if(s->inuse == 0){
+    s->prev->next = s->next;
+    s->next->prev = s->prev;
+    c->nslab--;
+    kfree(s);
+  }
+}
+
+// Allocate an object from c.  Its contents are undefined.
+// Returns 0 if the memory cannot be allocated.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  void *o;
+  int id;
+
+  push_off();
+  id = cpuid();
+  acquire(&c->cpu[id].lock);
+  if(c->cpu[id].n == 0){
+    acquire(&c->lock);
+    while(c->cpu[id].n < NOBJBATCH && (o = slaballoc(c)) != 0)
+      c->cpu[id].obj[c->cpu[id].n++] = o;
+    release(&c->lock);
+  }
+  o = 0;
+  if(c->cpu[id].n > 0)
+    o = c->cpu[id].obj[--c->cpu[id].n];
+  release(&c->cpu[id].lock);
+  pop_off();
+  return o;
+}
+
+// Free object o, which came from kmem_cache_alloc(c).
+void
+kmem_cache_free(struct kmem_cache *c, void *o)
+{
+  int id;
+
+  push_off();
+  id = cpuid();
+  acquire(&c->cpu[id].lock);
+  if(c->cpu[id].n == NOBJCACHE){
+    acquire(&c->lock);
+    while(c->cpu[id].n > NOBJCACHE - NOBJBATCH)
+      slabfree(c, c->cpu[id].obj[--c->cpu[id].n]);
+    release(&c->lock);
+  }
+  c->cpu[id].obj[c->cpu[id].n++] = o;
+  release(&c->cpu[id].lock);
+  pop_off();
+}
+
+// Format statistics for each kmem_cache into buf, one
+// line per cache: object size, objects per slab, number
+// of slabs, and objects in use.
+// Returns the number of bytes written.
+int
+slabstats(char *buf, int sz)
+{
+  struct kmem_cache *c;
+  int n = 0, cached;
+
+  n += snprintf(buf+n, sz-n, "--- slab caches\n");
+  for(c = kmcaches; c < &kmcaches[nkmcache]; c++){
+    cached = 0;
+    for(int i = 0; i < NCPU; i++)
+      cached += c->cpu[i].n;
+    acquire(&c->lock);
+    n += snprintf(buf+n, sz-n, "slab: %s: size %d per-slab %d slabs %d objects %d\n",
+                  c->name, c->size, c->perslab, c->nslab, c->nobj - cached);
+    release(&c->lock);
+  }
+  return n;
+}
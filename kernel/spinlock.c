@@ -8,12 +8,73 @@
 #include "proc.h"
 #include "defs.h"
 
+// every initialized lock that statslock() reports on, i.e. whose
+// name starts with one of lock_names, is recorded here.  Others,
+// such as the locks of inodes and pipes, which come and go, stay
+// out, so that initializing and freeing them doesn't search the
+// table.
+#define NLOCK 500
+
+static struct spinlock lock_locks = { .name = "lock_locks" };
+static struct spinlock *locks[NLOCK];
+static char *lock_names[] = { "kmem", "bcache" };
+
+// Does lock name start with prefix?
+static int
+lockmatch(struct spinlock *lk, char *prefix)
+{
+  return strncmp(lk->name, prefix, strlen(prefix)) == 0;
+}
+
+// Is lk one that statslock() reports on?
+static int
+lockstats(struct spinlock *lk)
+{
+  for(int j = 0; j < NELEM(lock_names); j++)
+    if(lockmatch(lk, lock_names[j]))
+      return 1;
+  return 0;
+}
+
 void
 initlock(struct spinlock *lk, char *name)
 {
+  int i;
+
   lk->name = name;
   lk->locked = 0;
   lk->cpu = 0;
+  lk->n = 0;
+  lk->nts = 0;
+
+  if(!lockstats(lk))
+    return;
+  acquire(&lock_locks);
+  for(i = 0; i < NLOCK; i++){
+    if(locks[i] == 0){
+      locks[i] = lk;
+      break;
+    }
+  }
+  if(i == NLOCK)
+    panic("initlock: locks");
+  release(&lock_locks);
+}
+
+// Forget about a lock that is about to be freed.
+void
+freelock(struct spinlock *lk)
+{
+  if(!lockstats(lk))
+    return;
+  acquire(&lock_locks);
+  for(int i = 0; i < NLOCK; i++){
+    if(locks[i] == lk){
+      locks[i] = 0;
+      break;
+    }
+  }
+  release(&lock_locks);
 }
 
 // Acquire the lock.
@@ -29,8 +90,14 @@ acquire(struct spinlock *lk)
   //   a5 = 1
   //   s1 = &lk->locked
   //   amoswap.w.aq a5, a5, (s1)
-  while(__sync_lock_test_and_set(&lk->locked, 1) != 0)
-    ;
+  // keep answering other harts' TLB flush requests, since
+  // with interrupts off their inter-processor interrupts
+  // wait, and the holder may be waiting for this hart's flush.
+  int nts = 0;
+  while(__sync_lock_test_and_set(&lk->locked, 1) != 0){
+    nts++;
+    tlbpoll();
+  }
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -40,6 +107,8 @@ acquire(struct spinlock *lk)
 
   // Record info about lock acquisition for holding() and debugging.
   lk->cpu = mycpu();
+  lk->n++;
+  lk->nts += nts;
 }
 
 // Release the lock.
@@ -108,3 +177,27 @@ pop_off(void)
   if(c->noff == 0 && c->intena)
     intr_on();
 }
+
+// Format statistics for the kmem and bcache locks into buf,
+// one line per lock, followed by the total number of
+// failed test-and-sets.  Returns the number of bytes written.
+int
+statslock(char *buf, int sz)
+{
+  struct spinlock *lk;
+  int n = 0;
+  uint tot = 0;
+
+  acquire(&lock_locks);
+  n += snprintf(buf+n, sz-n, "--- lock kmem/bcache stats\n");
+  for(int i = 0; i < NLOCK; i++){
+    if((lk = locks[i]) == 0)
+      continue;
+    tot += lk->nts;
+    n += snprintf(buf+n, sz-n, "lock: %s: #test-and-set %d #acquire() %d\n",
+                  lk->name, lk->nts, lk->n);
+  }
+  n += snprintf(buf+n, sz-n, "tot= %d\n", tot);
+  release(&lock_locks);
+  return n;
+}
@@ -49,9 +49,9 @@ start()
   asm volatile("mret");
 }
 
-// set up to receive timer interrupts in machine mode,
-// which arrive at timervec in kernelvec.S,
-// which turns them into software interrupts for
+// set up to receive timer interrupts and inter-processor
+// interrupts in machine mode, which arrive at timervec in
+// kernelvec.S, which turns them into software interrupts for
 // devintr() in trap.c.
 void
 timerinit()
@@ -67,9 +67,12 @@ timerinit()
   // scratch[0..3] : space for timervec to save registers.
   // scratch[4] : address of CLINT MTIMECMP register.
   // scratch[5] : desired interval (in cycles) between timer interrupts.
+  // scratch[6] : address of CLINT MSIP register.
+  // scratch[7] : set by each timer interrupt, see timerfired().
   uint64 *scratch = &mscratch0[32 * id];
   scratch[4] = CLINT_MTIMECMP(id);
   scratch[5] = interval;
+  scratch[6] = CLINT_MSIP(id);
   w_mscratch((uint64)scratch);
 
   // set the machine-mode trap handler.
@@ -78,6 +81,15 @@ timerinit()
   // enable machine-mode interrupts.
   w_mstatus(r_mstatus() | MSTATUS_MIE);
 
-  // enable machine-mode timer interrupts.
-  w_mie(r_mie() | MIE_MTIE);
+  // enable machine-mode timer and software interrupts.
+  w_mie(r_mie() | MIE_MTIE | MIE_MSIE);
+}
+
+// Has the timer interrupted this hart since the last call?
+// Tells devintr() a timer tick from an inter-processor interrupt,
+// which timervec turns into the same software interrupt.
+int
+timerfired(void)
+{
+  return __sync_lock_test_and_set(&mscratch0[32 * cpuid() + 7], 0) != 0;
 }
@@ -0,0 +1,68 @@
+//
+// the statistics device: reading it returns the
+// lock statistics formatted by statslock(), followed by
+// the physical memory allocator's from kstats() and
+// slabstats().
+//
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "riscv.h"
+#include "proc.h"
+#include "defs.h"
+
+#define BUFSZ 4096
+
+static struct {
+  struct sleeplock lock;
+  char buf[BUFSZ];
+  int sz;   // bytes in buf; 0 if no snapshot is being read
+  int off;  // bytes already handed out
+} stats;
+
+// Each sequence of reads returns one snapshot, then
+// a read of 0 bytes; the next read takes a fresh snapshot.
+// Holds a sleeplock, not a spinlock, since either_copyout()
+// may fault in a user page.
+int
+statsread(int user_dst, uint64 dst, int n)
+{
+  int m;
+
+  // see filereadi().
+  if(user_dst)
+    uvmprefault(myproc()->pagetable, dst, n, 1);
+  acquiresleep(&stats.lock);
+  if(stats.sz == 0){
+    stats.sz = statslock(stats.buf, BUFSZ);
+    stats.sz += kstats(stats.buf+stats.sz, BUFSZ-stats.sz);
+    stats.sz += slabstats(stats.buf+stats.sz, BUFSZ-stats.sz);
+    stats.off = 0;
+  }
+  m = stats.sz - stats.off;
+  if(m > n)
+    m = n;
+  if(m > 0){
+    if(either_copyout(user_dst, dst, stats.buf+stats.off, m) == -1){
+      releasesleep(&stats.lock);
+      return -1;
+    }
+    stats.off += m;
+  } else {
+    stats.sz = 0;
+  }
+  releasesleep(&stats.lock);
+  return m;
+}
+
+void
+statsinit(void)
+{
+  initsleeplock(&stats.lock, "stats");
+  devsw[STATS].read = statsread;
+  devsw[STATS].write = 0;
+}
@@ -38,18 +38,32 @@ sys_wait(void)
   return wait(p);
 }
 
+// Growing only raises the size; usertrap() allocates and
+// zeroes each page the first time the process touches it.
+// Shrinking frees pages immediately.
 uint64
 sys_sbrk(void)
 {
   int addr;
   int n;
+  struct vm *vm = myproc()->vm;
 
   if(argint(0, &n) < 0)
     return -1;
-  addr = myproc()->sz;
-  if(growproc(n) < 0)
-    return -1;
+  acquire(&vm->lock);
+  addr = vm->sz;
+  if(n > 0){
+    if(vm->sz + n >= USERTOP)
+      goto bad;
+    vm->sz += n;
+  } else if(growproc(n) < 0)
+    goto bad;
+  release(&vm->lock);
   return addr;
+
+ bad:
+  release(&vm->lock);
+  return -1;
 }
 
 uint64
@@ -83,6 +97,48 @@ sys_kill(void)
   return kill(pid);
 }
 
+uint64
+sys_clone(void)
+{
+  uint64 fn, arg, stack;
+
+  if(argaddr(0, &fn) < 0 || argaddr(1, &arg) < 0 || argaddr(2, &stack) < 0)
+    return -1;
+  return clone(fn, arg, stack);
+}
+
+uint64
+sys_join(void)
+{
+  int tid;
+  uint64 p;
+
+  if(argint(0, &tid) < 0 || argaddr(1, &p) < 0)
+    return -1;
+  return join(tid, p);
+}
+
+uint64
+sys_futex(void)
+{
+  uint64 addr;
+  int op, val;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &op) < 0 || argint(2, &val) < 0)
+    return -1;
+  return futex(addr, op, val);
+}
+
+uint64
+sys_setpriority(void)
+{
+  int pid, pri;
+
+  if(argint(0, &pid) < 0 || argint(1, &pri) < 0)
+    return -1;
+  return setpriority(pid, pri);
+}
+
 // return how many clock tick interrupts have occurred
 // since start.
 uint64
@@ -10,6 +10,7 @@ struct spinlock tickslock;
 uint ticks;
 
 extern char trampoline[], uservec[], userret[];
+extern char ucopystart[], ucopyend[], ucopyfault[];  // ucopy.S
 
 // in kernelvec.S, calls kerneltrap().
 void kernelvec();
@@ -65,6 +66,11 @@ usertrap(void)
     intr_on();
 
     syscall();
+  } else if((r_scause() == 12 || r_scause() == 13 || r_scause() == 15) &&
+            uvmfault(p, r_stval(), r_scause() == 15) == 0){
+    // page fault on a lazily allocated, lazily loaded, or
+    // copy-on-write page; the page is now mapped, so retry
+    // the faulting instruction.
   } else if((which_dev = devintr()) != 0){
     // ok
   } else {
@@ -76,9 +82,9 @@ usertrap(void)
   if(p->killed)
     exit(-1);
 
-  // give up the CPU if this is a timer interrupt.
+  // charge the tick; maybe give up the CPU.
   if(which_dev == 2)
-    yield();
+    timeslice();
 
   usertrapret();
 }
@@ -118,14 +124,15 @@ usertrapret(void)
   // set S Exception Program Counter to the saved user pc.
   w_sepc(p->trapframe->epc);
 
-  // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  // tell trampoline.S the user page table to switch to,
+  // with the ASID uvmswitch() gave the kernel page table.
+  uint64 satp = MAKE_SATP(p->pagetable) | SATP_ASID(SATP2ASID(r_satp()));
 
   // jump to trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
   // and switches to user mode with sret.
   uint64 fn = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64,uint64))fn)(TRAPFRAME, satp);
+  ((void (*)(uint64,uint64))fn)(THREADFRAME(p->tslot), satp);
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
@@ -143,7 +150,17 @@ kerneltrap()
   if(intr_get() != 0)
     panic("kerneltrap: interrupts enabled");
 
-  if((which_dev = devintr()) == 0){
+  if((scause == 13 || scause == 15) && myproc() != 0 &&
+     sepc >= (uint64)ucopystart && sepc < (uint64)ucopyend){
+    // a page fault while ucopy.S was using a user address.
+    // fault the page in and retry, or make ucopy() fail.
+    uint64 va = r_stval();
+    if(sstatus & SSTATUS_SPIE)
+      intr_on();
+    if(uvmfault(myproc(), va, scause == 15) < 0)
+      sepc = (uint64)ucopyfault;
+    intr_off();
+  } else if((which_dev = devintr()) == 0){
     printf("scause %p\n", scause);
     printf("sepc=%p stval=%p\n", r_sepc(), r_stval());
     panic("kerneltrap");
@@ -151,7 +168,7 @@ kerneltrap()
 
   // give up the CPU if this is a timer interrupt.
   if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
-    yield();
+    timeslice();
 
   // the yield() may have caused some traps to occur,
   // so restore trap registers for use by kernelvec.S's sepc instruction.
@@ -162,10 +179,23 @@ kerneltrap()
 void
 clockintr()
 {
+  uint t;
+
   acquire(&tickslock);
-  ticks++;
+  t = ++ticks;
   wakeup(&ticks);
   release(&tickslock);
+
+  if(t % BOOSTTICKS == 0)
+    boost();
+}
+
+// Send hart an inter-processor interrupt, which it sees
+// as a software interrupt that isn't a timer interrupt.
+void
+ipi(int hart)
+{
+  *(uint32*)KCLINT_MSIP(hart) = 1;
 }
 
 // check if it's an external interrupt or software interrupt,
@@ -201,17 +231,23 @@ devintr()
 
     return 1;
   } else if(scause == 0x8000000000000001L){
-    // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
+    // software interrupt from a machine-mode timer interrupt
+    // or inter-processor interrupt, forwarded by timervec in
+    // kernelvec.S.
 
-    if(cpuid() == 0){
-      clockintr();
-    }
-    
     // acknowledge the software interrupt by clearing
     // the SSIP bit in sip.
     w_sip(r_sip() & ~2);
 
+    // another hart may want this one to flush its TLB.
+    tlbpoll();
+    if(!timerfired())
+      return 1;
+
+    if(cpuid() == 0){
+      clockintr();
+    }
+
     return 2;
   } else {
     return 0;
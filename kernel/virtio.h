@@ -45,7 +45,8 @@
 
 // this many virtio descriptors.
 // must be a power of two.
-#define NUM 8
+// each request uses two plus one per block.
+#define NUM 64
 
 struct VRingDesc {
   uint64 addr;
@@ -65,6 +66,15 @@ struct VRingUsedElem {
 #define VIRTIO_BLK_T_IN  0 // read the disk
 #define VIRTIO_BLK_T_OUT 1 // write the disk
 
+// the format of the first descriptor in a disk request.
+// to be followed by one descriptor per block, and
+// a one-byte status.
+struct virtio_blk_req {
+  uint32 type; // VIRTIO_BLK_T_IN or ..._OUT
+  uint32 reserved;
+  uint64 sector;
+};
+
 struct UsedArea {
   uint16 flags;
   uint16 id;
@@ -5,6 +5,13 @@
 //
 // qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0
 //
+// virtio_disk_submit() queues a request and returns at once;
+// virtio_disk_intr() frees each request's descriptors as the
+// device completes it, and wakes up anyone in
+// virtio_disk_wait().  So callers can keep several requests
+// in flight.  A request can move up to MAXSG consecutive
+// blocks, with one data descriptor per buf.
+//
 
 #include "types.h"
 #include "riscv.h"
@@ -38,9 +45,14 @@ static struct disk {
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    struct buf *b[MAXSG];
+    int nb;
     char status;
   } info[NUM];
+
+  // disk command headers.
+  // one-for-one with descriptors, for convenience.
+  struct virtio_blk_req ops[NUM];
   
   struct spinlock vdisk_lock;
   
@@ -151,10 +163,11 @@ free_chain(int i)
   }
 }
 
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+allocn_desc(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -165,67 +178,79 @@ alloc3_desc(int *idx)
   return 0;
 }
 
+// Queue a request to read or write the n bufs in b, which
+// must hold consecutive blocks, and return without waiting
+// for it to finish.  Each b[i]->disk is 1 until the device
+// is done with it; see virtio_disk_wait().
+// Sleeps if there aren't enough free descriptors.
 void
-virtio_disk_rw(struct buf *b, int write)
+virtio_disk_submitv(struct buf **b, int n, int write)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  uint64 sector = b[0]->blockno * (BSIZE / 512);
+  int i;
+
+  if(n < 1 || n > MAXSG)
+    panic("virtio_disk_submitv");
+  for(i = 1; i < n; i++)
+    if(b[i]->blockno != b[0]->blockno + i)
+      panic("virtio_disk_submitv: not consecutive");
 
   acquire(&disk.vdisk_lock);
 
-  // the spec says that legacy block operations use three
-  // descriptors: one for type/reserved/sector, one for
-  // the data, one for a 1-byte status result.
+  // the spec says that legacy block operations use
+  // one descriptor for type/reserved/sector, then
+  // descriptors for the data, then one for a 1-byte
+  // status result.
 
-  // allocate the three descriptors.
-  int idx[3];
+  // allocate the n+2 descriptors.
+  int idx[MAXSG+2];
   while(1){
-    if(alloc3_desc(idx) == 0) {
+    if(allocn_desc(idx, n+2) == 0) {
       break;
     }
     sleep(&disk.free[0], &disk.vdisk_lock);
   }
   
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_outhdr {
-    uint32 type;
-    uint32 reserved;
-    uint64 sector;
-  } buf0;
+  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
 
   if(write)
-    buf0.type = VIRTIO_BLK_T_OUT; // write the disk
+    buf0->type = VIRTIO_BLK_T_OUT; // write the disk
   else
-    buf0.type = VIRTIO_BLK_T_IN; // read the disk
-  buf0.reserved = 0;
-  buf0.sector = sector;
-
-  // buf0 is on a kernel stack, which is not direct mapped,
-  // thus the call to kvmpa().
-  disk.desc[idx[0]].addr = (uint64) kvmpa((uint64) &buf0);
-  disk.desc[idx[0]].len = sizeof(buf0);
+    buf0->type = VIRTIO_BLK_T_IN; // read the disk
+  buf0->reserved = 0;
+  buf0->sector = sector;
+
+  disk.desc[idx[0]].addr = (uint64) buf0;
+  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(i = 1; i <= n; i++){
+    disk.desc[idx[i]].addr = (uint64) b[i-1]->data;
+    disk.desc[idx[i]].len = BSIZE;
+    if(write)
+      disk.desc[idx[i]].flags = 0; // device reads b->data
+    else
+      disk.desc[idx[i]].flags = VRING_DESC_F_WRITE; // device writes b->data
+    disk.desc[idx[i]].flags |= VRING_DESC_F_NEXT;
+    disk.desc[idx[i]].next = idx[i+1];
+  }
 
   disk.info[idx[0]].status = 0;
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
-
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  disk.desc[idx[n+1]].addr = (uint64) &disk.info[idx[0]].status;
+  disk.desc[idx[n+1]].len = 1;
+  disk.desc[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  disk.desc[idx[n+1]].next = 0;
+
+  // record struct bufs for virtio_disk_intr().
+  for(i = 0; i < n; i++){
+    b[i]->disk = 1;
+    disk.info[idx[0]].b[i] = b[i];
+  }
+  disk.info[idx[0]].nb = n;
 
   // avail[0] is flags
   // avail[1] tells the device how far to look in avail[2...].
@@ -237,34 +262,70 @@ virtio_disk_rw(struct buf *b, int write)
 
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
 
-  // Wait for virtio_disk_intr() to say request has finished.
+  release(&disk.vdisk_lock);
+}
+
+// Queue a request to read or write b.
+void
+virtio_disk_submit(struct buf *b, int write)
+{
+  virtio_disk_submitv(&b, 1, write);
+}
+
+// Wait for virtio_disk_intr() to say that the
+// request for b has finished.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
   while(b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
-
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
-
   release(&disk.vdisk_lock);
 }
 
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_submit(b, write);
+  virtio_disk_wait(b);
+}
+
 void
 virtio_disk_intr()
 {
   acquire(&disk.vdisk_lock);
 
+  // the device won't raise another interrupt until we tell it
+  // we've seen this interrupt, which the following line does.
+  // this may race with the device writing new entries to
+  // the "used" ring, in which case we may process the new
+  // completion entries in this interrupt, and have nothing to do
+  // in the next interrupt, which is harmless.
+  *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
+
+  __sync_synchronize();
+
   while((disk.used_idx % NUM) != (disk.used->id % NUM)){
     int id = disk.used->elems[disk.used_idx].id;
 
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
-    
-    disk.info[id].b->disk = 0;   // disk is done with buf
-    wakeup(disk.info[id].b);
+
+    free_chain(id);
+    for(int i = 0; i < disk.info[id].nb; i++){
+      struct buf *b = disk.info[id].b[i];
+      disk.info[id].b[i] = 0;
+      b->disk = 0;   // disk is done with buf
+      if(b->async)
+        bdone(b);    // nobody is waiting; see breadahead()
+      else
+        wakeup(b);
+    }
+    disk.info[id].nb = 0;
 
     disk.used_idx = (disk.used_idx + 1) % NUM;
   }
-  *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
 
   release(&disk.vdisk_lock);
 }
@@ -5,6 +5,8 @@
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
+#include "spinlock.h"
+#include "proc.h"
 
 /*
  * the kernel's page table.
@@ -15,12 +17,29 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+// Address space IDs.  Each process's address space (struct vm)
+// gets an ASID, which tags its TLB entries, so that switching
+// between address spaces needn't flush the TLB.  ASIDs are
+// handed out in order; when they run out, a new generation
+// starts, every hart flushes its whole TLB before using an ASID
+// of the new generation, and each address space gets a new ASID
+// when it next runs.  ASID 0 is the kernel page table's.
+#define NASID 256  // most ASIDs to use
+
+static struct spinlock asid_lock;
+static int nasid;          // ASIDs the hardware has, up to NASID
+static uint64 asidgen = 1; // current generation
+static uint64 asidnext = 1; // next ASID of this generation to hand out
+
+static pte_t *walkto(pagetable_t, uint64, int, int);
+
 /*
  * create a direct-map page table for the kernel.
  */
 void
 kvminit()
 {
+  initlock(&asid_lock, "asid");
   kernel_pagetable = (pagetable_t) kalloc();
   memset(kernel_pagetable, 0, PGSIZE);
 
@@ -30,8 +49,9 @@ kvminit()
   // virtio mmio disk interface
   kvmmap(VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
 
-  // CLINT
-  kvmmap(CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+  // CLINT inter-processor interrupt bits, for ipi().
+  // not at CLINT itself, which is a user address.
+  kvmmap(KCLINT, CLINT, PGSIZE, PTE_R | PTE_W);
 
   // PLIC
   kvmmap(PLIC, PLIC, 0x400000, PTE_R | PTE_W);
@@ -52,10 +72,132 @@ kvminit()
 void
 kvminithart()
 {
+  uint64 asids;
+
+  // the ASID bits the hardware lacks read back as zero.
+  w_satp(MAKE_SATP(kernel_pagetable) | SATP_ASID(SATP_ASIDMAX));
+  asids = SATP2ASID(r_satp()) + 1;
+  nasid = asids < NASID ? asids : NASID;
+
   w_satp(MAKE_SATP(kernel_pagetable));
   sfence_vma();
 }
 
+// Switch this hart to the kernel page table, without
+// flushing the TLB: it has only global mappings.
+void
+kvmswitch(void)
+{
+  push_off();
+  w_satp(MAKE_SATP(kernel_pagetable));
+  mycpu()->vm = 0;
+  pop_off();
+}
+
+// Switch this hart to vm's kernel page table, tagged with vm's
+// ASID, giving vm a new ASID first if its ASID is from an old
+// generation.  Flushes the TLB only if the hart has not yet
+// since the generation began, or if vm's PTEs have changed
+// since this hart last ran it (see uvmflush()); while it runs
+// vm, uvmflush() flushes it by inter-processor interrupt.
+// Without hardware ASIDs, always flushes the TLB.
+void
+uvmswitch(struct vm *vm)
+{
+  struct cpu *c;
+  uint64 asid;
+  int flush, stale;
+
+  push_off();
+  c = mycpu();
+
+  acquire(&asid_lock);
+  if(nasid <= 1){
+    vm->asid = 0;
+    flush = 1;
+  } else {
+    if(vm->asid >> 16 != asidgen){
+      if(asidnext == nasid){
+        asidgen++;
+        asidnext = 1;
+      }
+      vm->asid = (asidgen << 16) | asidnext++;
+    }
+    flush = c->asidgen != asidgen;
+    c->asidgen = asidgen;
+  }
+  asid = vm->asid & SATP_ASIDMAX;
+  release(&asid_lock);
+
+  // from here on uvmflush() interrupts this hart to flush
+  // changes to vm's PTEs; changes it made before are in stale.
+  acquire(&vm->lock);
+  c->vm = vm;
+  stale = (vm->stale >> cpuid()) & 1;
+  vm->stale &= ~(1 << cpuid());
+  release(&vm->lock);
+
+  w_satp(MAKE_SATP(vm->kpagetable) | SATP_ASID(asid));
+  if(flush)
+    sfence_vma();
+  else if(stale)
+    sfence_vma_asid(asid);
+  pop_off();
+}
+
+// Some of vm's PTEs have been removed, or changed to a
+// different physical page or fewer permissions: flush them
+// from the TLB of every hart.  This hart flushes vm's ASID at
+// once if it is running vm; every other hart running vm gets
+// an inter-processor interrupt, and uvmflush() waits until it
+// has flushed its TLB; the rest flush vm's ASID before they
+// next switch to vm.  Only then may the caller free pages
+// that the old PTEs referred to.
+// Caller must hold vm->lock.
+void
+uvmflush(struct vm *vm)
+{
+  struct cpu *c;
+  uint64 want[NCPU];
+  int id = cpuid();
+
+  vm->stale = ~0;
+  // order the PTE changes before the requests.
+  __sync_synchronize();
+  for(c = cpus; c < &cpus[NCPU]; c++){
+    want[c - cpus] = 0;
+    if(c - cpus != id && c->vm == vm){
+      want[c - cpus] = __sync_add_and_fetch(&c->tlbreq, 1);
+      ipi(c - cpus);
+    }
+  }
+  if(mycpu()->vm == vm){
+    sfence_vma_asid(SATP2ASID(r_satp()));
+    vm->stale &= ~(1 << id);
+  }
+  for(c = cpus; c < &cpus[NCPU]; c++){
+    while(__atomic_load_n(&c->tlbdone, __ATOMIC_ACQUIRE) < want[c - cpus])
+      tlbpoll();
+  }
+}
+
+// Flush this hart's TLB if uvmflush() on another hart has asked
+// it to.  Called for the inter-processor interrupt, and by harts
+// spinning with interrupts off, so that two harts never wait
+// for each other's flushes.
+// Interrupts must be off.
+void
+tlbpoll(void)
+{
+  struct cpu *c = mycpu();
+  uint64 req = __atomic_load_n(&c->tlbreq, __ATOMIC_ACQUIRE);
+
+  if(c->tlbdone != req){
+    sfence_vma();
+    __atomic_store_n(&c->tlbdone, req, __ATOMIC_RELEASE);
+  }
+}
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page-table pages.
@@ -68,15 +210,29 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// A level-1 PTE can also be a leaf, which maps a whole 2MB
+// megapage (and has PTE_MEGA set); if va lies in a megapage,
+// walk() returns its level-1 PTE.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  return walkto(pagetable, va, alloc, 0);
+}
+
+// Like walk(), but return the PTE at the given level
+// (0, or 1 for a megapage), unless a leaf above it maps va.
+static pte_t *
+walkto(pagetable_t pagetable, uint64 va, int alloc, int depth)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
+  for(int level = 2; level > depth; level--) {
     pte_t *pte = &pagetable[PX(level, va)];
     if(*pte & PTE_V) {
+      if(*pte & (PTE_R|PTE_W|PTE_X))
+        return pte;
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
       if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
@@ -85,7 +241,7 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
-  return &pagetable[PX(0, va)];
+  return &pagetable[PX(depth, va)];
 }
 
 // Look up a virtual address, return the physical address,
@@ -108,6 +264,8 @@ walkaddr(pagetable_t pagetable, uint64 va)
   if((*pte & PTE_U) == 0)
     return 0;
   pa = PTE2PA(*pte);
+  if(*pte & PTE_MEGA)
+    pa += PGROUNDDOWN(va % MEGAPGSIZE);
   return pa;
 }
 
@@ -117,7 +275,11 @@ walkaddr(pagetable_t pagetable, uint64 va)
 void
 kvmmap(uint64 va, uint64 pa, uint64 sz, int perm)
 {
-  if(mappages(kernel_pagetable, va, sz, pa, perm) != 0)
+  // every page table has the same kernel mappings, which
+  // must stay clear of user addresses.
+  if(va < USERTOP)
+    panic("kvmmap: user address");
+  if(mappages(kernel_pagetable, va, sz, pa, perm | PTE_G) != 0)
     panic("kvmmap");
 }
 
@@ -138,42 +300,90 @@ kvmpa(uint64 va)
   if((*pte & PTE_V) == 0)
     panic("kvmpa");
   pa = PTE2PA(*pte);
+  if(*pte & PTE_MEGA)
+    off = va % MEGAPGSIZE;
   return pa+off;
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
-// be page-aligned. Returns 0 on success, -1 if walk() couldn't
+// be page-aligned. Wherever va and pa are both 2MB-aligned and
+// at least 2MB remain, maps a megapage with one level-1 PTE.
+// Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 {
-  uint64 a, last;
+  uint64 a, last, n;
   pte_t *pte;
+  int mega;
 
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
   for(;;){
-    if((pte = walk(pagetable, a, 1)) == 0)
+    mega = a % MEGAPGSIZE == 0 && pa % MEGAPGSIZE == 0 &&
+           last - a >= MEGAPGSIZE - PGSIZE;
+    if((pte = walkto(pagetable, a, 1, mega)) == 0)
       return -1;
     if(*pte & PTE_V)
       panic("remap");
-    *pte = PA2PTE(pa) | perm | PTE_V;
-    if(a == last)
+    *pte = PA2PTE(pa) | perm | PTE_V | (mega ? PTE_MEGA : 0);
+    n = mega ? MEGAPGSIZE : PGSIZE;
+    if(last - a < n)
       break;
-    a += PGSIZE;
-    pa += PGSIZE;
+    a += n;
+    pa += n;
   }
   return 0;
 }
 
-// Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
-// Optionally free the physical memory.
-void
-uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
+// Replace the megapage mapping *pte with a level-0 page-table
+// page of 4096-byte mappings of the same memory, so that its
+// pages can be unmapped or shared one at a time.
+// Returns 0 on success, -1 if out of memory.
+static int
+megasplit(pte_t *pte)
 {
-  uint64 a;
+  pagetable_t pagetable;
+  uint64 pa = PTE2PA(*pte);
+  uint flags = PTE_FLAGS(*pte) & ~PTE_MEGA;
+
+  if((pagetable = (pagetable_t) kalloc()) == 0)
+    return -1;
+  for(int i = 0; i < 512; i++)
+    pagetable[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  ksplit((void*)pa, MEGAORDER);
+  *pte = PA2PTE(pagetable) | PTE_V;
+  return 0;
+}
+
+#define NGATHER 32  // pages unmap() frees per TLB flush
+
+// Free the n blocks at pa[], of 2^order[i] pages each, which
+// unmap() has removed from a page table, flushing them from
+// every TLB first if the page table is vm's.
+static void
+unmapfree(struct vm *vm, uint64 *pa, int *order, int n)
+{
+  if(vm)
+    uvmflush(vm);
+  for(int i = 0; i < n; i++){
+    if(order[i])
+      kfree_order((void*)pa[i], order[i]);
+    else
+      kfree((void*)pa[i]);
+  }
+}
+
+// Remove npages of mappings starting from va, and optionally
+// free the physical memory; see uvmunmap().  If vm isn't 0, the
+// page table is vm's, which threads on other harts may be using,
+// so free the pages in batches, each after a uvmflush(vm).
+static void
+unmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free, struct vm *vm)
+{
+  uint64 a, pa[NGATHER];
+  int order[NGATHER], n = 0;
   pte_t *pte;
 
   if((va % PGSIZE) != 0)
@@ -181,17 +391,39 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
     if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+      continue;
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
     if(do_free){
-      uint64 pa = PTE2PA(*pte);
-      kfree((void*)pa);
+      pa[n] = PTE2PA(*pte);
+      order[n++] = (*pte & PTE_MEGA) ? MEGAORDER : 0;
+    }
+    if(*pte & PTE_MEGA){
+      if(a % MEGAPGSIZE != 0 || va + npages*PGSIZE - a < MEGAPGSIZE)
+        panic("uvmunmap: part of megapage");
+      a += MEGAPGSIZE - PGSIZE;
     }
     *pte = 0;
+    if(n == NGATHER){
+      unmapfree(vm, pa, order, n);
+      n = 0;
+    }
   }
+  if(n > 0 || vm)
+    unmapfree(vm, pa, order, n);
+}
+
+// Remove npages of mappings starting from va. va must be
+// page-aligned. Pages that were never touched by a lazily
+// allocating process have no mapping and are skipped.
+// Megapages must be removed whole.
+// Optionally free the physical memory.
+void
+uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
+{
+  unmap(pagetable, va, npages, do_free, 0);
 }
 
 // create an empty user page table.
@@ -252,23 +484,49 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 }
 
 // Deallocate user pages to bring the process size from oldsz to
-// newsz.  oldsz and newsz need not be page-aligned, nor does newsz
-// need to be less than oldsz.  oldsz can be larger than the actual
-// process size.  Returns the new process size.
-uint64
-uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
+// newsz; see uvmdealloc().  If vm isn't 0, the page table is
+// vm's, and the pages are freed as unmap() says.
+static uint64
+dealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, struct vm *vm)
 {
+  pte_t *pte;
+
   if(newsz >= oldsz)
     return oldsz;
 
   if(PGROUNDUP(newsz) < PGROUNDUP(oldsz)){
+    pte = walk(pagetable, PGROUNDUP(newsz), 0);
+    if(pte && (*pte & PTE_MEGA) && PGROUNDUP(newsz) % MEGAPGSIZE != 0 &&
+       megasplit(pte) != 0)
+      return oldsz;
     int npages = (PGROUNDUP(oldsz) - PGROUNDUP(newsz)) / PGSIZE;
-    uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1);
+    unmap(pagetable, PGROUNDUP(newsz), npages, 1, vm);
   }
 
   return newsz;
 }
 
+// Deallocate user pages to bring the process size from oldsz to
+// newsz.  oldsz and newsz need not be page-aligned, nor does newsz
+// need to be less than oldsz.  oldsz can be larger than the actual
+// process size.  Returns the new process size, which is still
+// oldsz if a megapage that newsz cuts in two couldn't be split.
+uint64
+uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
+{
+  return dealloc(pagetable, oldsz, newsz, 0);
+}
+
+// Shrink vm's user memory from oldsz to newsz, like uvmdealloc(),
+// but free the pages only once no hart's TLB maps them, since
+// other threads of vm may be running on other harts.
+// Caller must hold vm->lock.
+uint64
+uvmshrink(struct vm *vm, uint64 oldsz, uint64 newsz)
+{
+  return dealloc(vm->pagetable, oldsz, newsz, vm);
+}
+
 // Recursively free page-table pages.
 // All leaf mappings must already have been removed.
 void
@@ -299,10 +557,55 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
+// Create the kernel page table of a process whose user page
+// table is pagetable.  It has the kernel's mappings, and shares
+// pagetable's page-table page for the lowest 1GB, so that every
+// user mapping below USERTOP (= PLIC) shows up in both, and the
+// kernel can use user addresses directly.  To make that work,
+// pagetable gets the kernel's device mappings above USERTOP,
+// without PTE_U; ukvmfree() takes them out again.
+// Returns 0 if out of memory.
+pagetable_t
+ukvmcreate(pagetable_t pagetable)
+{
+  pagetable_t kpagetable, low, klow;
+
+  if((kpagetable = (pagetable_t) kalloc()) == 0)
+    return 0;
+  if(walk(pagetable, 0, 1) == 0){
+    kfree(kpagetable);
+    return 0;
+  }
+  low = (pagetable_t) PTE2PA(pagetable[0]);
+  klow = (pagetable_t) PTE2PA(kernel_pagetable[0]);
+  for(int i = PX(1, USERTOP); i < 512; i++)
+    low[i] = klow[i];
+
+  memmove(kpagetable, kernel_pagetable, PGSIZE);
+  kpagetable[0] = pagetable[0];
+  return kpagetable;
+}
+
+// Free a kernel page table made by ukvmcreate() for
+// pagetable, before pagetable itself is freed.
+void
+ukvmfree(pagetable_t kpagetable, pagetable_t pagetable)
+{
+  pagetable_t low = (pagetable_t) PTE2PA(pagetable[0]);
+
+  for(int i = PX(1, USERTOP); i < 512; i++)
+    low[i] = 0;
+  kfree(kpagetable);
+}
+
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Copies only the page table: the child shares the
+// parent's physical pages, and writable pages are made
+// read-only and copy-on-write in both page tables, so
+// that the first store to one (see uvmcow) gives the
+// storing process its own copy.  Megapages in old are
+// split first, so that they can be shared page by page.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
@@ -311,22 +614,21 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
 
   for(i = 0; i < sz; i += PGSIZE){
     if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
+      continue;  // lazily allocated and not yet touched.
     if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+      continue;
+    if((*pte & PTE_MEGA) && (megasplit(pte) != 0 || (pte = walk(old, i, 0)) == 0))
+      goto err;
+    if(*pte & PTE_W)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
-      goto err;
-    }
+    kdup((void*)pa);
   }
   return 0;
 
@@ -335,6 +637,216 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
   return -1;
 }
 
+// Handle a store to the copy-on-write page at va:
+// give pagetable a private, writable copy of the page.
+// If no other page table still refers to the page,
+// just make it writable again.  If pagetable is vm's,
+// flush the old page from every TLB before dropping it.
+// Returns 0 on success, -1 if va is not a copy-on-write
+// user page or if memory is exhausted.
+static int
+uvmcow(struct vm *vm, pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0)
+    return -1;
+  if((*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 || (*pte & PTE_COW) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+
+  if(krefs((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+    return 0;
+  }
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  if(vm)
+    uvmflush(vm);
+  kfree((void*)pa);
+  return 0;
+}
+
+// Can uvmfault() map the whole 2MB megapage around va in vm at
+// once?  Only if it is all below vm->sz, none of it is mapped
+// yet, and it holds no lazily loaded program segment.
+// Caller must hold vm->lock.
+static int
+megaok(struct vm *vm, uint64 va)
+{
+  uint64 a = MEGAROUNDDOWN(va);
+  struct seg *s;
+  pte_t *pte;
+
+  if(a + MEGAPGSIZE > vm->sz)
+    return 0;
+  for(s = vm->segs; s < &vm->segs[NSEG]; s++){
+    if(s->filesz != 0 && s->va < a + MEGAPGSIZE && a < s->va + s->filesz)
+      return 0;
+  }
+  pte = walkto(vm->pagetable, a, 0, 1);
+  return pte == 0 || (*pte & PTE_V) == 0;
+}
+
+// Handle a page fault at user virtual address va in process p.
+// If va is below the size of p's memory but not yet mapped,
+// map a zeroed page there, first reading its contents from the
+// program file if it belongs to a lazily loaded exec() segment;
+// sbrk() also grows the process lazily, and a large enough
+// untouched region gets a whole zeroed megapage, if one is free.
+// A store (write) to a copy-on-write page gets a private copy.
+// p->vm->lock keeps p's threads from changing the page table
+// at the same time, but isn't held while reading the file.
+// Returns 0 if the faulting access can be retried,
+// -1 if va is not valid or memory is exhausted.
+int
+uvmfault(struct proc *p, uint64 va, int write)
+{
+  struct vm *vm = p->vm;
+  pagetable_t pagetable = p->pagetable;
+  pte_t *pte;
+  char *mem;
+  int r, mega;
+
+  if(va >= MAXVA)
+    return -1;
+  acquire(&vm->lock);
+  pte = walk(pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    r = -1;
+    if(write && (*pte & PTE_COW)){
+      r = uvmcow(vm, pagetable, va);
+    } else if((*pte & PTE_U) &&
+              (*pte & (write ? PTE_W : PTE_R|PTE_X))){
+      // the PTE allows the access, so this hart's TLB
+      // didn't have it yet, or had an old version.
+      sfence_vma_va(va);
+      r = 0;
+    }
+    release(&vm->lock);
+    return r;
+  }
+  if(va >= vm->sz){
+    release(&vm->lock);
+    return -1;
+  }
+  mega = megaok(vm, va);
+  release(&vm->lock);
+
+  if(mega && (mem = kalloc_order(MEGAORDER)) != 0){
+    va = MEGAROUNDDOWN(va);
+    memset(mem, 0, MEGAPGSIZE);
+    acquire(&vm->lock);
+    if(!megaok(vm, va)){
+      // another thread mapped part of it, or sbrk() shrank
+      // the memory, meanwhile; retry.
+      release(&vm->lock);
+      kfree_order(mem, MEGAORDER);
+      return 0;
+    }
+    if(mappages(pagetable, va, MEGAPGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
+      release(&vm->lock);
+      kfree_order(mem, MEGAORDER);
+      return -1;
+    }
+    release(&vm->lock);
+    sfence_vma_va(va);
+    return 0;
+  }
+
+  va = PGROUNDDOWN(va);
+  if((mem = kalloc()) == 0)
+    return -1;
+  memset(mem, 0, PGSIZE);
+  if(loadpage(p, va, mem) < 0){
+    kfree(mem);
+    return -1;
+  }
+
+  acquire(&vm->lock);
+  pte = walk(pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    // another thread faulted the page in meanwhile.
+    release(&vm->lock);
+    kfree(mem);
+    return 0;
+  }
+  if(va >= vm->sz ||
+     mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
+    release(&vm->lock);
+    kfree(mem);
+    return -1;
+  }
+  release(&vm->lock);
+  sfence_vma_va(va);
+  return 0;
+}
+
+// Return the physical address for a kernel access to user
+// virtual address va in pagetable, after resolving any page
+// fault the access would cause, just as usertrap() would.
+// Pages are only faulted in to the current process's page
+// table; in any other, only copy-on-write faults are resolved.
+// May sleep, to read a page of the program file, so the caller
+// must not hold any spinlocks.
+// Returns 0 if va is not accessible.
+static uint64
+uvmaccess(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+
+  if(va >= MAXVA)
+    return 0;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0 || (write && (*pte & PTE_COW))){
+    if(p && pagetable == p->pagetable){
+      if(uvmfault(p, va, write) < 0)
+        return 0;
+    } else if(pte == 0 || (*pte & PTE_V) == 0 || uvmcow(0, pagetable, va) < 0){
+      return 0;
+    }
+  }
+  return walkaddr(pagetable, va);
+}
+
+// Return the physical address of user virtual address va in
+// pagetable, making its page present and writable (not
+// copy-on-write) first, so that the address stays the same
+// until the page is unmapped.  May sleep.
+// Returns 0 if va is not accessible.
+uint64
+uvmwaddr(pagetable_t pagetable, uint64 va)
+{
+  uint64 va0 = PGROUNDDOWN(va);
+  uint64 pa0 = uvmaccess(pagetable, va0, 1);
+
+  if(pa0 == 0)
+    return 0;
+  return pa0 + (va - va0);
+}
+
+// Fault in the pages of user addresses [va, va+len) in
+// pagetable, for writing if write is set, stopping at the
+// first inaccessible one.  May sleep.
+void
+uvmprefault(pagetable_t pagetable, uint64 va, uint64 len, int write)
+{
+  for(uint64 a = PGROUNDDOWN(va); a < va + len; a += PGSIZE)
+    if(uvmaccess(pagetable, a, write) == 0)
+      break;
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -348,6 +860,26 @@ uvmclear(pagetable_t pagetable, uint64 va)
   *pte &= ~PTE_U;
 }
 
+// Can the kernel use user virtual address va in pagetable
+// directly, for len bytes?  Only if pagetable is the current
+// process's, whose kernel page table is in use, and the bytes
+// are all below USERTOP and miss the stack guard page, which
+// the kernel can still read and write with SUM set.  Such
+// accesses go through ucopy.S, so that kerneltrap() can
+// handle their page faults.
+static int
+udirect(pagetable_t pagetable, uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+  uint64 guard;
+
+  if(p == 0 || pagetable != p->pagetable ||
+     va >= USERTOP || len > USERTOP - va)
+    return 0;
+  guard = p->vm->guard;
+  return guard == 0 || va + len <= guard || va >= guard + PGSIZE;
+}
+
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
 // Return 0 on success, -1 on error.
@@ -356,9 +888,12 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
 
+  if(udirect(pagetable, dstva, len))
+    return ucopy((void*)dstva, src, len);
+
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmaccess(pagetable, va0, 1);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (dstva - va0);
@@ -381,9 +916,12 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
   uint64 n, va0, pa0;
 
+  if(udirect(pagetable, srcva, len))
+    return ucopy(dst, (void*)srcva, len);
+
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmaccess(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -408,9 +946,18 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   uint64 n, va0, pa0;
   int got_null = 0;
 
+  if(udirect(pagetable, srcva, 1)){
+    uint64 guard = myproc()->vm->guard;
+    if(max > USERTOP - srcva)
+      max = USERTOP - srcva;
+    if(srcva < guard && max > guard - srcva)
+      max = guard - srcva;
+    return ucopystr(dst, (char*)srcva, max);
+  }
+
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmaccess(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
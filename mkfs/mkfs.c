@@ -40,6 +40,7 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+void wdir(uint inum, uint parent, struct dirent *de, int n);
 
 // convert to intel byte order
 ushort
@@ -67,11 +68,10 @@ xint(uint x)
 int
 main(int argc, char *argv[])
 {
-  int i, cc, fd;
-  uint rootino, inum, off;
-  struct dirent de;
+  int i, cc, fd, nde;
+  uint rootino, inum;
+  struct dirent de[NINODES];
   char buf[BSIZE];
-  struct dinode din;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
@@ -118,16 +118,7 @@ main(int argc, char *argv[])
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
-
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
-
+  nde = 0;
   for(i = 2; i < argc; i++){
     // get rid of "user/"
     char *shortname;
@@ -152,10 +143,11 @@ main(int argc, char *argv[])
 
     inum = ialloc(T_FILE);
 
-    bzero(&de, sizeof(de));
-    de.inum = xshort(inum);
-    strncpy(de.name, shortname, DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    assert(nde < NINODES);
+    bzero(&de[nde], sizeof(de[nde]));
+    de[nde].inum = xshort(inum);
+    strncpy(de[nde].name, shortname, DIRSIZ);
+    nde++;
 
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
@@ -163,12 +155,7 @@ main(int argc, char *argv[])
     close(fd);
   }
 
-  // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
+  wdir(rootino, rootino, de, nde);
 
   balloc(freeblock);
 
@@ -303,3 +290,61 @@ iappend(uint inum, void *xp, int n)
   din.size = xint(off);
   winode(inum, &din);
 }
+
+int
+hashcmp(const void *a, const void *b)
+{
+  uint ha = dirhash(((struct dirent*)a)->name);
+  uint hb = dirhash(((struct dirent*)b)->name);
+
+  return ha < hb ? -1 : ha > hb;
+}
+
+// Write the contents of directory inum, whose parent is
+// parent: "." and "..", and the n entries de.  If they
+// don't fit in one block, write an indexed directory whose
+// leaves are half full, leaving the kernel room to add names.
+void
+wdir(uint inum, uint parent, struct dirent *de, int n)
+{
+  char buf[BSIZE];
+  struct dirtop *t = (struct dirtop*)buf;
+  int i, nleaf, start[NDIRLEAF+1];
+
+  bzero(buf, BSIZE);
+  t->dot.inum = xshort(inum);
+  strcpy(t->dot.name, ".");
+  t->dotdot.inum = xshort(parent);
+  strcpy(t->dotdot.name, "..");
+
+  if(n <= DPB - 2){
+    bcopy(de, &t->head, n * sizeof(*de));
+    iappend(inum, buf, BSIZE);
+    return;
+  }
+
+  // a leaf must hold all names with the same hash.
+  qsort(de, n, sizeof(*de), hashcmp);
+  nleaf = 0;
+  for(i = 0; i < n; ){
+    assert(nleaf < NDIRLEAF);
+    start[nleaf] = i;
+    IXHASH(t, nleaf) = xint(nleaf == 0 ? 0 : dirhash(de[i].name));
+    IXBN(t, nleaf) = xshort(nleaf + 1);
+    nleaf++;
+    i = min(i + DPB/2, n);
+    while(i < n && dirhash(de[i].name) == dirhash(de[i-1].name))
+      i++;
+    assert(i - start[nleaf-1] <= DPB);
+  }
+  start[nleaf] = n;
+  t->head.nleaf = xshort(nleaf);
+  t->head.magic = xint(DIRMAGIC);
+  iappend(inum, buf, BSIZE);
+
+  for(i = 0; i < nleaf; i++){
+    bzero(buf, BSIZE);
+    bcopy(de + start[i], buf, (start[i+1] - start[i]) * sizeof(*de));
+    iappend(inum, buf, BSIZE);
+  }
+}
@@ -0,0 +1,165 @@
+// Measure buffer cache lock contention.
+//
+// bcachetest creates one small file per child, then forks
+// NCHILD processes that each read their own file over and
+// over.  The data blocks of different files hash to different
+// buffer cache buckets, so the children should rarely contend
+// for a bcache lock.  The lock statistics are read from the
+// "statistics" device before and after the run.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/param.h"
+#include "kernel/spinlock.h"
+#include "kernel/sleeplock.h"
+#include "kernel/fs.h"
+#include "kernel/file.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define NCHILD 4    // concurrent readers
+#define NBLK   4    // blocks per file
+#define ROUNDS 500  // times each child reads its file
+
+char buf[BSIZE];
+char stats[4096];
+
+// read the statistics device into stats.
+void
+readstats(void)
+{
+  int fd, n, off;
+
+  if((fd = open("statistics", O_RDONLY)) < 0){
+    mknod("statistics", STATS, 0);
+    if((fd = open("statistics", O_RDONLY)) < 0){
+      printf("bcachetest: cannot open statistics\n");
+      exit(1);
+    }
+  }
+  off = 0;
+  while(off < sizeof(stats)-1 && (n = read(fd, stats+off, sizeof(stats)-1-off)) > 0)
+    off += n;
+  stats[off] = 0;
+  close(fd);
+}
+
+// return the number following key in s, or 0.
+int
+field(char *s, char *key)
+{
+  int n = strlen(key);
+
+  for(; *s && *s != '\n'; s++)
+    if(memcmp(s, key, n) == 0)
+      return atoi(s + n);
+  return 0;
+}
+
+// sum the acquire and test-and-set counts of the bcache locks.
+void
+bcachestats(int *acquires, int *tas)
+{
+  char *s;
+
+  readstats();
+  *acquires = *tas = 0;
+  for(s = stats; *s; s++){
+    if(memcmp(s, "lock: bcache", 12) == 0){
+      *acquires += field(s, "#acquire() ");
+      *tas += field(s, "#test-and-set ");
+    }
+    while(*s && *s != '\n')
+      s++;
+    if(*s == 0)
+      break;
+  }
+}
+
+void
+createfile(char *name)
+{
+  int fd;
+
+  if((fd = open(name, O_CREATE|O_WRONLY)) < 0){
+    printf("bcachetest: create %s failed\n", name);
+    exit(1);
+  }
+  for(int i = 0; i < NBLK; i++){
+    memset(buf, 'a' + i, sizeof(buf));
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("bcachetest: write %s failed\n", name);
+      exit(1);
+    }
+  }
+  close(fd);
+}
+
+void
+readfile(char *name)
+{
+  int fd;
+
+  for(int r = 0; r < ROUNDS; r++){
+    if((fd = open(name, O_RDONLY)) < 0){
+      printf("bcachetest: open %s failed\n", name);
+      exit(1);
+    }
+    for(int i = 0; i < NBLK; i++){
+      if(read(fd, buf, sizeof(buf)) != sizeof(buf) || buf[0] != 'a' + i){
+        printf("bcachetest: read %s failed\n", name);
+        exit(1);
+      }
+    }
+    close(fd);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  char name[4] = "bc0";
+  int a0, t0, a1, t1, start, xstatus, ok = 1;
+
+  for(int i = 0; i < NCHILD; i++){
+    name[2] = '0' + i;
+    createfile(name);
+  }
+
+  bcachestats(&a0, &t0);
+  start = uptime();
+  for(int i = 0; i < NCHILD; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("bcachetest: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      name[2] = '0' + i;
+      readfile(name);
+      exit(0);
+    }
+  }
+  for(int i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      ok = 0;
+  }
+  bcachestats(&a1, &t1);
+
+  printf("bcachetest: %d readers, %d block reads in %d ticks\n",
+         NCHILD, NCHILD * ROUNDS * NBLK, uptime() - start);
+  printf("bcachetest: bcache locks: #acquire() %d #test-and-set %d\n",
+         a1 - a0, t1 - t0);
+
+  for(int i = 0; i < NCHILD; i++){
+    name[2] = '0' + i;
+    unlink(name);
+  }
+  if(!ok){
+    printf("bcachetest: FAILED\n");
+    exit(1);
+  }
+  printf("bcachetest: OK\n");
+  exit(0);
+}
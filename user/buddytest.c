@@ -0,0 +1,195 @@
+// Stress the buddy allocator.
+//
+// buddytest forks NCHILD processes that each, for ROUNDS
+// rounds, grow their heap by a random amount, touch every
+// page, sometimes fork a child that writes to all of it, and
+// shrink the heap again.  Small amounts take single pages from
+// the per-CPU caches; large 2MB-aligned ones take whole
+// megapages (order-9 blocks), which fork() then splits.
+// Afterwards the "statistics" device must show that every page
+// came back, and that blocks merged again into at least one
+// free megapage.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "kernel/param.h"
+#include "kernel/spinlock.h"
+#include "kernel/sleeplock.h"
+#include "kernel/fs.h"
+#include "kernel/file.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define NCHILD 4   // concurrent allocators
+#define ROUNDS 40  // rounds each child runs
+
+char stats[4096];
+
+unsigned long randstate = 1;
+unsigned int
+rand()
+{
+  randstate = randstate * 1664525 + 1013904223;
+  return randstate;
+}
+
+// read the statistics device into stats.
+void
+readstats(void)
+{
+  int fd, n, off;
+
+  if((fd = open("statistics", O_RDONLY)) < 0){
+    mknod("statistics", STATS, 0);
+    if((fd = open("statistics", O_RDONLY)) < 0){
+      printf("buddytest: cannot open statistics\n");
+      exit(1);
+    }
+  }
+  off = 0;
+  while(off < sizeof(stats)-1 && (n = read(fd, stats+off, sizeof(stats)-1-off)) > 0)
+    off += n;
+  stats[off] = 0;
+  close(fd);
+}
+
+// return the number following key in stats, or -1.
+int
+field(char *key)
+{
+  int n = strlen(key);
+
+  for(char *s = stats; *s; s++){
+    if(memcmp(s, key, n) == 0){
+      s += n;
+      return *s == '-' ? -atoi(s + 1) : atoi(s);
+    }
+  }
+  return -1;
+}
+
+// read the statistics; return the number of free
+// pages and set *largest to the largest free order.
+int
+freepages(int *largest)
+{
+  readstats();
+  *largest = field("largest: ");
+  return field("free pages: ");
+}
+
+// grow the heap by n bytes, fill it, and check it.
+void
+churn(uint64 n, int forkit)
+{
+  char *a, *p;
+  int pid, xstatus;
+
+  if((a = sbrk(n)) == (char*)-1){
+    printf("buddytest: sbrk(%d) failed\n", (int)n);
+    exit(1);
+  }
+  for(p = a; p < a + n; p += PGSIZE)
+    *p = (uint64)p / PGSIZE;
+  if(forkit){
+    pid = fork();
+    if(pid < 0){
+      printf("buddytest: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      for(p = a; p < a + n; p += PGSIZE)
+        *p = 0;
+      exit(0);
+    }
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+  for(p = a; p < a + n; p += PGSIZE){
+    if(*p != (char)((uint64)p / PGSIZE)){
+      printf("buddytest: bad data at %p\n", p);
+      exit(1);
+    }
+  }
+  if(sbrk(-n) == (char*)-1){
+    printf("buddytest: sbrk(-%d) failed\n", (int)n);
+    exit(1);
+  }
+}
+
+void
+child(int i)
+{
+  uint64 brk, pad;
+
+  randstate = i + 1;
+  for(int r = 0; r < ROUNDS; r++){
+    switch(rand() % 3){
+    case 0:
+      churn((1 + rand() % 16) * PGSIZE, rand() % 4 == 0);
+      break;
+    case 1:
+      churn((64 + rand() % 192) * PGSIZE, rand() % 4 == 0);
+      break;
+    case 2:
+      // pad the heap to a 2MB boundary first.
+      brk = (uint64)sbrk(0);
+      pad = MEGAROUNDUP(brk) - brk;
+      if(sbrk(pad) == (char*)-1){
+        printf("buddytest: sbrk failed\n");
+        exit(1);
+      }
+      churn((1 + rand() % 2) * MEGAPGSIZE, rand() % 4 == 0);
+      sbrk(-pad);
+      break;
+    }
+  }
+  exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int free0, free1, largest, xstatus, ok = 1;
+
+  free0 = freepages(&largest);
+  if(free0 < 0){
+    printf("buddytest: no allocator statistics\n");
+    exit(1);
+  }
+  printf("buddytest: %d free pages, largest free block order %d\n", free0, largest);
+
+  for(int i = 0; i < NCHILD; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("buddytest: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0)
+      child(i);
+  }
+  for(int i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      ok = 0;
+  }
+
+  free1 = freepages(&largest);
+  printf("buddytest: %d free pages, largest free block order %d\n", free1, largest);
+  if(!ok){
+    printf("buddytest: a child failed\n");
+    exit(1);
+  }
+  if(free1 < free0){
+    printf("buddytest: FAIL %d pages leaked\n", free0 - free1);
+    exit(1);
+  }
+  if(largest < MEGAORDER){
+    printf("buddytest: FAIL no free megapage\n");
+    exit(1);
+  }
+  printf("buddytest: OK\n");
+  exit(0);
+}
@@ -9,6 +9,13 @@ cat(int fd)
 {
   int n;
 
+  // from a file to a pipe, or a pipe to a file, the
+  // kernel can move the data without going through buf.
+  while((n = splice(fd, 1, 8192)) > 0)
+    ;
+  if(n == 0)
+    return;
+
   while((n = read(fd, buf, sizeof(buf))) > 0) {
     if (write(1, buf, n) != n) {
       fprintf(2, "cat: write error\n");
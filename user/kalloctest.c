@@ -0,0 +1,102 @@
+// Measure physical page allocator throughput.
+//
+// kalloctest forks 1, 2, ... NCHILD processes that each
+// repeatedly grow their heap by NPAGE pages, touch every page,
+// and shrink it again, for DURATION clock ticks.  Every cycle
+// calls kalloc() and kfree() NPAGE times, so the total number
+// of cycles shows how allocation throughput scales with the
+// number of harts (make CPUS=n qemu).
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define NCHILD   4   // largest number of concurrent allocators
+#define NPAGE    32  // pages allocated per cycle
+#define DURATION 20  // ticks each measurement runs for
+
+// grow and shrink the heap until DURATION ticks have passed.
+// return the number of pages allocated.
+int
+churn(void)
+{
+  int n = 0;
+  int t0 = uptime();
+
+  while(uptime() - t0 < DURATION){
+    char *a = sbrk(NPAGE*PGSIZE);
+    if(a == (char*)-1){
+      printf("kalloctest: sbrk failed\n");
+      exit(1);
+    }
+    for(int i = 0; i < NPAGE; i++)
+      a[i*PGSIZE] = i;
+    if(sbrk(-NPAGE*PGSIZE) == (char*)-1){
+      printf("kalloctest: sbrk shrink failed\n");
+      exit(1);
+    }
+    n += NPAGE;
+  }
+  return n;
+}
+
+// run nchild allocators concurrently; return total pages allocated.
+int
+measure(int nchild)
+{
+  int fds[2], i, n, total;
+
+  if(pipe(fds) < 0){
+    printf("kalloctest: pipe failed\n");
+    exit(1);
+  }
+  for(i = 0; i < nchild; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("kalloctest: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      close(fds[0]);
+      n = churn();
+      if(write(fds[1], &n, sizeof(n)) != sizeof(n)){
+        printf("kalloctest: write failed\n");
+        exit(1);
+      }
+      exit(0);
+    }
+  }
+  close(fds[1]);
+
+  total = 0;
+  for(i = 0; i < nchild; i++){
+    if(read(fds[0], &n, sizeof(n)) != sizeof(n)){
+      printf("kalloctest: read failed\n");
+      exit(1);
+    }
+    total += n;
+  }
+  close(fds[0]);
+  for(i = 0; i < nchild; i++)
+    wait(0);
+  return total;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int base = 0;
+
+  printf("kalloctest: %d ticks per run, %d pages per cycle\n", DURATION, NPAGE);
+  for(int nchild = 1; nchild <= NCHILD; nchild++){
+    int n = measure(nchild);
+    if(nchild == 1)
+      base = n;
+    printf("%d allocators: %d pages, %d pages/tick", nchild, n, n / DURATION);
+    if(base > 0)
+      printf(", speedup x%d.%d", n / base, (n * 10 / base) % 10);
+    printf("\n");
+  }
+  exit(0);
+}
@@ -0,0 +1,165 @@
+// User-level threads, on top of the clone() and join()
+// system calls.  Every thread gets its own stack from
+// malloc(); the threads of a process share everything else,
+// and may run on different harts at once.
+//
+// Threads synchronize with spinning tlocks, or with mutexes
+// and condition variables, which sleep in futex() when they
+// have to wait.
+//
+// malloc() and free() are not thread-safe: threads that use
+// them must hold a lock around the calls.
+
+#include "kernel/types.h"
+#include "kernel/futex.h"
+#include "user/user.h"
+
+#define MAXTHREAD 16    // live threads created by this library
+#define TSTACK    4096  // bytes of stack per thread
+
+struct thread {
+  int tid;              // 0 if the slot is free
+  char *stack;
+  int (*fn)(void*);
+  void *arg;
+};
+
+static struct thread threads[MAXTHREAD];
+static struct mutex lock;  // protects threads[] and malloc()
+
+void
+tlock_acquire(struct tlock *lk)
+{
+  while(__sync_lock_test_and_set(&lk->locked, 1) != 0)
+    ;
+  __sync_synchronize();
+}
+
+void
+tlock_release(struct tlock *lk)
+{
+  __sync_synchronize();
+  __sync_lock_release(&lk->locked);
+}
+
+// A mutex's locked is 0 if it is free, 1 if it is held,
+// and 2 if it is held and other threads may be waiting,
+// so that an uncontended mutex_unlock() needn't call futex().
+void
+mutex_lock(struct mutex *m)
+{
+  int c;
+
+  if((c = __sync_val_compare_and_swap(&m->locked, 0, 1)) == 0)
+    return;
+  if(c != 2)
+    c = __atomic_exchange_n(&m->locked, 2, __ATOMIC_ACQUIRE);
+  while(c != 0){
+    futex(&m->locked, FUTEX_WAIT, 2);
+    c = __atomic_exchange_n(&m->locked, 2, __ATOMIC_ACQUIRE);
+  }
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+  if(__atomic_fetch_sub(&m->locked, 1, __ATOMIC_RELEASE) != 1){
+    __atomic_store_n(&m->locked, 0, __ATOMIC_RELEASE);
+    futex(&m->locked, FUTEX_WAKE, 1);
+  }
+}
+
+// Release m, wait for cond_signal() or cond_broadcast(),
+// and reacquire m.  May return spuriously, so callers
+// must recheck their condition.
+void
+cond_wait(struct cond *c, struct mutex *m)
+{
+  int seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+
+  mutex_unlock(m);
+  futex(&c->seq, FUTEX_WAIT, seq);
+  mutex_lock(m);
+}
+
+void
+cond_signal(struct cond *c)
+{
+  __atomic_fetch_add(&c->seq, 1, __ATOMIC_RELEASE);
+  futex(&c->seq, FUTEX_WAKE, 1);
+}
+
+void
+cond_broadcast(struct cond *c)
+{
+  __atomic_fetch_add(&c->seq, 1, __ATOMIC_RELEASE);
+  futex(&c->seq, FUTEX_WAKE, MAXTHREAD);
+}
+
+// the new thread starts here, via clone().
+static void
+start(void *arg)
+{
+  struct thread *t = arg;
+
+  exit(t->fn(t->arg));
+}
+
+// Start a thread running fn(arg); the thread exits with fn's
+// return value when fn returns.  Returns the thread id, or -1.
+int
+thread_create(int (*fn)(void*), void *arg)
+{
+  struct thread *t;
+  char *stack;
+  int tid;
+
+  mutex_lock(&lock);
+  for(t = threads; t < &threads[MAXTHREAD]; t++)
+    if(t->tid == 0 && t->stack == 0)
+      break;
+  if(t == &threads[MAXTHREAD] || (stack = malloc(TSTACK)) == 0){
+    mutex_unlock(&lock);
+    return -1;
+  }
+  t->stack = stack;
+  t->fn = fn;
+  t->arg = arg;
+  mutex_unlock(&lock);
+
+  // the riscv stack pointer must be 16-byte aligned.
+  tid = clone(start, t, (void*)((uint64)(stack + TSTACK) & ~0xfL));
+
+  mutex_lock(&lock);
+  if(tid < 0){
+    free(stack);
+    t->stack = 0;
+  } else {
+    t->tid = tid;
+  }
+  mutex_unlock(&lock);
+  return tid;
+}
+
+// Wait for thread tid, which the calling thread must have
+// created, to exit, and free its stack.  Stores its exit
+// status in *status if status is not 0.  Returns tid, or -1.
+int
+thread_join(int tid, int *status)
+{
+  struct thread *t;
+
+  if(tid <= 0 || join(tid, status) != tid)
+    return -1;
+  mutex_lock(&lock);
+  for(t = threads; t < &threads[MAXTHREAD]; t++){
+    if(t->tid == tid){
+      free(t->stack);
+      t->stack = 0;
+      t->tid = 0;
+      break;
+    }
+  }
+  mutex_unlock(&lock);
+  return tid;
+}
@@ -23,6 +23,12 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int fsync(int);
+int setpriority(int, int);
+int clone(void (*)(void*), void*, void*);
+int join(int, int*);
+int futex(int*, int, int);
+int splice(int, int, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -40,3 +46,23 @@ void free(void*);
 int atoi(const char*);
 int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
+
+// thread.c
+struct tlock {
+  uint locked;
+};
+int thread_create(int (*)(void*), void*);
+int thread_join(int, int*);
+void tlock_acquire(struct tlock*);
+void tlock_release(struct tlock*);
+struct mutex {
+  int locked;
+};
+struct cond {
+  int seq;
+};
+void mutex_lock(struct mutex*);
+void mutex_unlock(struct mutex*);
+void cond_wait(struct cond*, struct mutex*);
+void cond_signal(struct cond*);
+void cond_broadcast(struct cond*);
@@ -4,6 +4,7 @@
 #include "user/user.h"
 #include "kernel/fs.h"
 #include "kernel/fcntl.h"
+#include "kernel/futex.h"
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
@@ -1952,6 +1953,979 @@ forktest(char *s)
   }
 }
 
+// does fork() share the parent's memory copy-on-write?
+// the parent uses more than half of physical memory,
+// so fork() can only succeed if the child shares it.
+void
+cowfork(char *s)
+{
+  int sz = (PHYSTOP - KERNBASE) / 5 * 3;
+  int pid, xstatus;
+  char *a, *p;
+
+  a = sbrk(sz);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk(%d) failed\n", s, sz);
+    exit(1);
+  }
+  for(p = a; p < a + sz; p += PGSIZE)
+    *(int*)p = (int)(p - a);
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    // the child sees the parent's memory, and its own stores
+    // must not be visible to the parent.
+    for(p = a; p < a + sz; p += 64*PGSIZE){
+      if(*(int*)p != (int)(p - a)){
+        printf("%s: child saw wrong value\n", s);
+        exit(1);
+      }
+      *(int*)p = -1;
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+
+  for(p = a; p < a + sz; p += PGSIZE){
+    if(*(int*)p != (int)(p - a)){
+      printf("%s: child's store visible to parent\n", s);
+      exit(1);
+    }
+  }
+  if(sbrk(-sz) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk(-%d) failed\n", s, sz);
+    exit(1);
+  }
+}
+
+// exec() reads a program's pages in only when they are first
+// touched. can a system call read a page of initialized data
+// that the program itself has never touched?
+char lazydata[2*PGSIZE] = { [PGSIZE+7] = 'y' };
+
+void
+lazyexec(char *s)
+{
+  int fds[2];
+  char b[8];
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], &lazydata[PGSIZE], sizeof(b)) != sizeof(b)){
+    printf("%s: write from untouched data failed\n", s);
+    exit(1);
+  }
+  if(read(fds[0], b, sizeof(b)) != sizeof(b) || b[0] != 0 || b[7] != 'y'){
+    printf("%s: wrong data read from untouched page\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// fsync() of a freshly written file, and of a bad fd.
+void
+fsynctest(char *s)
+{
+  int fd;
+  char buf[16];
+
+  unlink("fsyncf");
+  fd = open("fsyncf", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create fsyncf failed\n", s);
+    exit(1);
+  }
+  if(write(fd, "fsync", 5) != 5){
+    printf("%s: write fsyncf failed\n", s);
+    exit(1);
+  }
+  if(fsync(fd) != 0){
+    printf("%s: fsync failed\n", s);
+    exit(1);
+  }
+  // nothing left to commit.
+  if(fsync(fd) != 0){
+    printf("%s: second fsync failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(fsync(fd) != -1){
+    printf("%s: fsync of closed fd succeeded\n", s);
+    exit(1);
+  }
+
+  fd = open("fsyncf", O_RDONLY);
+  if(fd < 0 || read(fd, buf, sizeof(buf)) != 5 || memcmp(buf, "fsync", 5) != 0){
+    printf("%s: fsyncf has wrong contents\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("fsyncf");
+}
+
+// setpriority() of self and of a child, and bad arguments.
+void
+priority(char *s)
+{
+  int pid, pri, xstatus;
+
+  pri = setpriority(0, -1);
+  if(pri < 0 || pri >= NPRIO){
+    printf("%s: bad priority %d\n", s, pri);
+    exit(1);
+  }
+  if(setpriority(0, NPRIO-1) != pri || setpriority(0, -1) != NPRIO-1){
+    printf("%s: setpriority of self failed\n", s);
+    exit(1);
+  }
+  if(setpriority(0, NPRIO) != -1){
+    printf("%s: setpriority accepted priority %d\n", s, NPRIO);
+    exit(1);
+  }
+  if(setpriority(-1, 0) != -1){
+    printf("%s: setpriority of bad pid succeeded\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    sleep(2);
+    exit(0);
+  }
+  if(setpriority(pid, 1) < 0 || setpriority(pid, -1) != 1){
+    printf("%s: setpriority of child failed\n", s);
+    exit(1);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+}
+
+// the kernel copies to and from user memory directly, so
+// system calls must fault in lazily allocated, copy-on-write
+// and unaligned buffers, and fail cleanly on bad ones.
+void
+ucopytest(char *s)
+{
+  enum { N = 3*PGSIZE + 5 };
+  int fds[2], i, pid, xstatus;
+  char *a, *b;
+
+  a = sbrk(2*N);
+  if(a == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  b = a + N;
+  for(i = 0; i < N; i++)
+    a[i] = i % 251;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    // a is copy-on-write now, and b+1 was never touched.
+    if(pipe(fds) < 0)
+      exit(1);
+    if(fork() == 0){
+      close(fds[0]);
+      if(write(fds[1], a, N) != N)
+        exit(1);
+      exit(0);
+    }
+    close(fds[1]);
+    for(i = 0; i < N; ){
+      int n = read(fds[0], b + 1 + i, N - i);
+      if(n <= 0)
+        exit(1);
+      i += n;
+    }
+    wait(&xstatus);
+    if(xstatus != 0 || memcmp(a, b + 1, N) != 0)
+      exit(1);
+    if(read(fds[0], b, 1) != 0 || pipe((int*)(b + N)) != -1)
+      exit(1);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: copy through lazy or copy-on-write pages failed\n", s);
+    exit(1);
+  }
+  if(fstat(0, (struct stat*)0xfffffffff0) != -1 ||
+     fstat(0, (struct stat*)USERTOP) != -1){
+    printf("%s: fstat to a bad address succeeded\n", s);
+    exit(1);
+  }
+  sbrk(-2*N);
+}
+
+// read() and write() bandwidth: large transfers between user
+// memory and a file small enough to stay in the buffer cache,
+// so that the copies dominate.  Prints the rate.
+void
+copybw(char *s)
+{
+  enum { N = 16*1024, ROUNDS = 128 };
+  static char cbuf[N];
+  int fd, i, j, t0, ticks;
+
+  for(i = 0; i < N; i++)
+    cbuf[i] = i % 251;
+  unlink("copybw");
+
+  t0 = uptime();
+  for(i = 0; i < ROUNDS; i++){
+    fd = open("copybw", O_CREATE|O_WRONLY);
+    if(fd < 0 || write(fd, cbuf, N) != N){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+    close(fd);
+  }
+  ticks = uptime() - t0;
+  if(ticks == 0)
+    ticks = 1;
+  printf("%s: %d-byte writes: %d KB/tick\n", s, N, ROUNDS*(N/1024)/ticks);
+
+  memset(cbuf, 0, N);
+  t0 = uptime();
+  for(i = 0; i < ROUNDS; i++){
+    fd = open("copybw", O_RDONLY);
+    if(fd < 0 || read(fd, cbuf, N) != N){
+      printf("%s: read failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    for(j = 0; j < N; j += 997){
+      if(cbuf[j] != (char)(j % 251)){
+        printf("%s: wrong byte at %d\n", s, j);
+        exit(1);
+      }
+    }
+  }
+  ticks = uptime() - t0;
+  if(ticks == 0)
+    ticks = 1;
+  printf("%s: %d-byte reads: %d KB/tick\n", s, N, ROUNDS*(N/1024)/ticks);
+  unlink("copybw");
+}
+
+// state shared by the threads of the threads test.
+struct tlock tcountlock;
+int tcount;
+char *theap;
+int tfd;
+
+int
+tcounter(void *arg)
+{
+  for(int i = 0; i < 1000; i++){
+    tlock_acquire(&tcountlock);
+    tcount++;
+    tlock_release(&tcountlock);
+  }
+  return (uint64)arg;
+}
+
+int
+tgrower(void *arg)
+{
+  theap = sbrk(PGSIZE);
+  if(theap == (char*)-1)
+    return 1;
+  theap[0] = 'x';
+  tfd = open("README", 0);
+  return 0;
+}
+
+// threads share memory and open files, and run in parallel.
+void
+threads(char *s)
+{
+  enum { NT = 4 };
+  int tid[NT], i, xstatus;
+  struct stat st;
+
+  tcount = 0;
+  for(i = 0; i < NT; i++){
+    if((tid[i] = thread_create(tcounter, (void*)(uint64)i)) < 0){
+      printf("%s: thread_create failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < NT; i++){
+    if(thread_join(tid[i], &xstatus) != tid[i] || xstatus != i){
+      printf("%s: thread_join failed\n", s);
+      exit(1);
+    }
+  }
+  if(tcount != NT*1000){
+    printf("%s: count %d, expected %d\n", s, tcount, NT*1000);
+    exit(1);
+  }
+
+  // wait() doesn't see threads, and join() only sees threads.
+  if(wait(0) != -1 || join(0, 0) != -1){
+    printf("%s: wait or join found a child\n", s);
+    exit(1);
+  }
+
+  tfd = -1;
+  if((i = thread_create(tgrower, 0)) < 0 ||
+     thread_join(i, &xstatus) != i || xstatus != 0){
+    printf("%s: tgrower failed\n", s);
+    exit(1);
+  }
+  if(theap + PGSIZE != sbrk(0) || theap[0] != 'x'){
+    printf("%s: thread's sbrk not shared\n", s);
+    exit(1);
+  }
+  if(tfd < 0 || fstat(tfd, &st) < 0 || close(tfd) < 0){
+    printf("%s: thread's open file not shared\n", s);
+    exit(1);
+  }
+}
+
+// state shared by the threads of the futextest test.
+struct mutex fmutex;
+struct cond fcond;
+int fcount;
+int fturn;
+
+// take turns with the other threads, in order of arg.
+int
+fworker(void *arg)
+{
+  int me = (uint64)arg;
+
+  for(int i = 0; i < 100; i++){
+    mutex_lock(&fmutex);
+    while(fturn % 4 != me)
+      cond_wait(&fcond, &fmutex);
+    fturn++;
+    fcount++;
+    cond_broadcast(&fcond);
+    mutex_unlock(&fmutex);
+  }
+  return 0;
+}
+
+// the waiter of futextest's fork check.
+int fword;
+int fdone;
+
+int
+fwaiter(void *arg)
+{
+  while(fword == 0)
+    futex(&fword, FUTEX_WAIT, 0);
+  fdone = 1;
+  return 0;
+}
+
+void
+futextest(char *s)
+{
+  enum { NT = 4 };
+  int tid[NT], i, xstatus;
+  int word = 1;
+
+  // futex only sleeps if the word holds the expected value.
+  if(futex(&word, FUTEX_WAIT, 2) != -1){
+    printf("%s: futex wait on stale value slept\n", s);
+    exit(1);
+  }
+  if(futex(&word, FUTEX_WAKE, 1) != 0){
+    printf("%s: futex woke a phantom waiter\n", s);
+    exit(1);
+  }
+  if(futex((int*)0xfffffffff0, FUTEX_WAKE, 1) != -1 ||
+     futex((int*)((char*)&word + 1), FUTEX_WAKE, 1) != -1){
+    printf("%s: futex accepted a bad address\n", s);
+    exit(1);
+  }
+
+  fcount = 0;
+  fturn = 0;
+  for(i = 0; i < NT; i++){
+    if((tid[i] = thread_create(fworker, (void*)(uint64)i)) < 0){
+      printf("%s: thread_create failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < NT; i++){
+    if(thread_join(tid[i], &xstatus) != tid[i] || xstatus != 0){
+      printf("%s: thread_join failed\n", s);
+      exit(1);
+    }
+  }
+  if(fcount != NT*100){
+    printf("%s: count %d, expected %d\n", s, fcount, NT*100);
+    exit(1);
+  }
+
+  // fork() makes fword's page copy-on-write, so storing to it
+  // moves it to another physical page; the waiter must still
+  // be woken.
+  fword = 0;
+  fdone = 0;
+  if((tid[0] = thread_create(fwaiter, 0)) < 0){
+    printf("%s: thread_create failed\n", s);
+    exit(1);
+  }
+  sleep(2);
+  if((i = fork()) < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(i == 0)
+    exit(0);
+  wait(0);
+  fword = 1;
+  futex(&fword, FUTEX_WAKE, 1);
+  for(i = 0; i < 50 && !fdone; i++)
+    sleep(1);
+  if(!fdone){
+    printf("%s: futex waiter not woken after fork\n", s);
+    exit(1);
+  }
+  thread_join(tid[0], &xstatus);
+}
+
+// sbrk() enough memory for whole 2MB megapages, which the kernel
+// maps with single PTEs, and check that they are zeroed, survive
+// fork() (which splits them) and a shrink into their middle.
+void
+megapages(char *s)
+{
+  char *start, *a;
+  uint64 pad;
+  int i, pid, xstatus;
+
+  start = sbrk(0);
+  pad = MEGAROUNDUP((uint64)start) - (uint64)start;
+  if(sbrk(pad + 2*MEGAPGSIZE) != start){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  a = start + pad;
+  for(i = 0; i < 2*MEGAPGSIZE; i += PGSIZE){
+    if(a[i] != 0){
+      printf("%s: new memory not zeroed\n", s);
+      exit(1);
+    }
+    a[i] = i / PGSIZE;
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(i = 0; i < 2*MEGAPGSIZE; i += PGSIZE){
+      if(a[i] != (char)(i / PGSIZE))
+        exit(1);
+      a[i] = 0;
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong contents\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 2*MEGAPGSIZE; i += PGSIZE){
+    if(a[i] != (char)(i / PGSIZE)){
+      printf("%s: child's stores reached the parent\n", s);
+      exit(1);
+    }
+  }
+
+  // touch a fresh megapage, then cut it in two.
+  a += 2*MEGAPGSIZE;
+  if(sbrk(MEGAPGSIZE) != a){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  a[0] = 1;
+  if(sbrk(-(MEGAPGSIZE/2)) == (char*)-1){
+    printf("%s: sbrk shrink failed\n", s);
+    exit(1);
+  }
+  if(a[0] != 1 || a[MEGAPGSIZE/2 - 1] != 0){
+    printf("%s: lost memory below the break\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    a[MEGAPGSIZE/2] = 1;
+    printf("%s: wrote above the break\n", s);
+    exit(1);
+  }
+  wait(&xstatus);
+  if(xstatus != -1){
+    printf("%s: store above the break wasn't fatal\n", s);
+    exit(1);
+  }
+
+  if(sbrk(-(sbrk(0) - start)) == (char*)-1){
+    printf("%s: sbrk shrink failed\n", s);
+    exit(1);
+  }
+}
+
+// open more files and inodes at once, from several processes,
+// than the kernel's fixed-size tables used to hold (100 open
+// files, 50 inodes).
+void
+manyfiles(char *s)
+{
+  enum { NCHILD = 12, NF = 5, NP = 2 };
+  int i, j, pid, xstatus, fails, fds[2], report[2], done[2];
+  char name[5], c;
+
+  if(pipe(report) < 0 || pipe(done) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  name[0] = 'm';
+  name[1] = 'f';
+  name[4] = 0;
+  for(i = 0; i < NCHILD; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      close(report[0]);
+      close(done[1]);
+      name[2] = 'a' + i;
+      c = 'y';
+      for(j = 0; j < NF; j++){
+        name[3] = '0' + j;
+        if(open(name, O_CREATE|O_RDWR) < 0)
+          c = 'n';
+      }
+      for(j = 0; j < NP; j++){
+        if(pipe(fds) < 0)
+          c = 'n';
+      }
+      write(report[1], &c, 1);
+      // keep everything open until all children are done.
+      read(done[0], &c, 1);
+      exit(0);
+    }
+  }
+  close(report[1]);
+  close(done[0]);
+
+  fails = 0;
+  for(i = 0; i < NCHILD; i++){
+    if(read(report[0], &c, 1) != 1 || c != 'y')
+      fails++;
+  }
+  close(done[1]);
+  close(report[0]);
+  for(i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      fails++;
+  }
+  for(i = 0; i < NCHILD; i++){
+    name[2] = 'a' + i;
+    for(j = 0; j < NF; j++){
+      name[3] = '0' + j;
+      unlink(name);
+    }
+  }
+  if(fails){
+    printf("%s: %d children couldn't open all their files\n", s, fails);
+    exit(1);
+  }
+}
+
+// pipe bandwidth: push data through a pipe with writes and
+// reads of several sizes, check every byte, and print the rate.
+void
+pipebw(char *s)
+{
+  static char pbuf[32768];
+  static int sizes[] = { 64, 512, 4096, 32768 };
+  enum { TOTAL = 2*1024*1024 };
+  int fds[2], i, j, k, n, pid, t0, ticks, xstatus;
+
+  for(i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++){
+    if(pipe(fds) < 0){
+      printf("%s: pipe failed\n", s);
+      exit(1);
+    }
+    t0 = uptime();
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      // every size is a multiple of 64, so one fill will do.
+      close(fds[0]);
+      for(j = 0; j < sizes[i]; j++)
+        pbuf[j] = (j % 64) ^ 0x5a;
+      for(k = 0; k < TOTAL; k += sizes[i]){
+        if(write(fds[1], pbuf, sizes[i]) != sizes[i]){
+          printf("%s: write failed\n", s);
+          exit(1);
+        }
+      }
+      exit(0);
+    }
+    close(fds[1]);
+    for(k = 0; (n = read(fds[0], pbuf, sizes[i])) > 0; k += n){
+      for(j = 0; j < n; j++){
+        if(pbuf[j] != (char)(((k + j) % 64) ^ 0x5a)){
+          printf("%s: wrong byte at %d\n", s, k + j);
+          exit(1);
+        }
+      }
+    }
+    close(fds[0]);
+    wait(&xstatus);
+    ticks = uptime() - t0;
+    if(n < 0 || k != TOTAL || xstatus != 0){
+      printf("%s: read %d bytes, expected %d\n", s, k, TOTAL);
+      exit(1);
+    }
+    if(ticks == 0)
+      ticks = 1;
+    printf("%s: %d-byte transfers: %d KB/tick\n", s, sizes[i], TOTAL/1024/ticks);
+  }
+}
+
+// splice() a file into a pipe and a pipe into a file.
+void
+splicetest(char *s)
+{
+  enum { N = 10000 };
+  static char sbuf[N];
+  int fd, fd2, fds[2], i, n, pid, xstatus;
+
+  for(i = 0; i < N; i++)
+    sbuf[i] = i % 251;
+  if((fd = open("splice", O_CREATE|O_RDWR)) < 0 || write(fd, sbuf, N) != N){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  // file -> pipe, in a child; check what comes out.
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[0]);
+    if((fd = open("splice", O_RDONLY)) < 0)
+      exit(1);
+    for(i = 0; (n = splice(fd, fds[1], 3000)) > 0; i += n)
+      ;
+    exit(n == 0 && i == N ? 0 : 1);
+  }
+  close(fds[1]);
+  memset(sbuf, 0, N);
+  for(i = 0; i < N && (n = read(fds[0], sbuf + i, N - i)) > 0; i += n)
+    ;
+  close(fds[0]);
+  wait(&xstatus);
+  if(i != N || xstatus != 0){
+    printf("%s: spliced %d bytes into a pipe, expected %d\n", s, i, N);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    if(sbuf[i] != (char)(i % 251)){
+      printf("%s: wrong byte %d from file\n", s, i);
+      exit(1);
+    }
+  }
+
+  // pipe -> file, from a child's writes.
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[0]);
+    exit(write(fds[1], sbuf, N) == N ? 0 : 1);
+  }
+  close(fds[1]);
+  if((fd = open("splice2", O_CREATE|O_RDWR)) < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; (n = splice(fds[0], fd, N)) > 0; i += n)
+    ;
+  wait(&xstatus);
+  if(n != 0 || i != N || xstatus != 0){
+    printf("%s: spliced %d bytes into a file, expected %d\n", s, i, N);
+    exit(1);
+  }
+
+  // only between a pipe and a file.
+  if((fd2 = open("splice", O_RDONLY)) < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  if(splice(fd2, fd, 10) != -1 || splice(fds[0], fds[0], 10) != -1){
+    printf("%s: splice without a pipe and a file succeeded\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fd2);
+  close(fd);
+
+  fd = open("splice2", O_RDONLY);
+  memset(sbuf, 0, N);
+  if(fd < 0 || read(fd, sbuf, N) != N){
+    printf("%s: read splice2 failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  for(i = 0; i < N; i++){
+    if(sbuf[i] != (char)(i % 251)){
+      printf("%s: wrong byte %d in file\n", s, i);
+      exit(1);
+    }
+  }
+  unlink("splice");
+  unlink("splice2");
+}
+
+// cycle through more inodes than the inode cache keeps
+// unreferenced, and check that recycled entries don't
+// show stale contents.
+void
+icachetest(char *s)
+{
+  enum { N = 2*NINODE };
+  int fd, i, r, v;
+  char name[5];
+
+  name[0] = 'i';
+  name[1] = 'c';
+  name[4] = 0;
+  for(i = 0; i < N; i++){
+    name[2] = '0' + i / 10;
+    name[3] = '0' + i % 10;
+    if((fd = open(name, O_CREATE|O_RDWR)) < 0 || write(fd, &i, sizeof(i)) != sizeof(i)){
+      printf("%s: create %s failed\n", s, name);
+      exit(1);
+    }
+    close(fd);
+  }
+  for(r = 0; r < 2; r++){
+    for(i = 0; i < N; i++){
+      name[2] = '0' + i / 10;
+      name[3] = '0' + i % 10;
+      if((fd = open(name, O_RDONLY)) < 0 || read(fd, &v, sizeof(v)) != sizeof(v) || v != i){
+        printf("%s: %s has the wrong contents\n", s, name);
+        exit(1);
+      }
+      close(fd);
+    }
+  }
+  for(i = 0; i < N; i++){
+    name[2] = '0' + i / 10;
+    name[3] = '0' + i % 10;
+    if(unlink(name) < 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+
+  // a new file may get a freed inode, which must start empty.
+  name[2] = name[3] = '0';
+  if((fd = open(name, O_CREATE|O_RDWR)) < 0 || read(fd, &v, sizeof(v)) != 0){
+    printf("%s: new file isn't empty\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink(name);
+}
+
+// lookups must see creates and unlinks, including of a
+// directory that is removed and made again.
+void
+dcachetest(char *s)
+{
+  struct stat st;
+  int fd;
+
+  unlink("dc/f");
+  unlink("dc");
+  if(stat("dc", &st) == 0 || stat("dc", &st) == 0){
+    printf("%s: stat found a missing directory\n", s);
+    exit(1);
+  }
+  if(mkdir("dc") < 0 || stat("dc", &st) < 0){
+    printf("%s: mkdir dc failed\n", s);
+    exit(1);
+  }
+  if((fd = open("dc/f", O_CREATE|O_RDWR)) < 0){
+    printf("%s: create dc/f failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(stat("dc/f", &st) < 0 || stat("dc/./f", &st) < 0 || stat("dc/../dc/f", &st) < 0){
+    printf("%s: stat dc/f failed\n", s);
+    exit(1);
+  }
+  if(link("dc/f", "dc/g") < 0 || unlink("dc/f") < 0){
+    printf("%s: link or unlink failed\n", s);
+    exit(1);
+  }
+  if(open("dc/f", O_RDONLY) >= 0 || stat("dc/g", &st) < 0){
+    printf("%s: lookup after unlink went wrong\n", s);
+    exit(1);
+  }
+  if(unlink("dc/g") < 0 || unlink("dc") < 0){
+    printf("%s: unlink failed\n", s);
+    exit(1);
+  }
+
+  // the new dc may get the old one's inode.
+  if(mkdir("dc") < 0){
+    printf("%s: mkdir dc again failed\n", s);
+    exit(1);
+  }
+  if(stat("dc/g", &st) == 0 || stat("dc/f", &st) == 0){
+    printf("%s: new dc has old entries\n", s);
+    exit(1);
+  }
+  if(unlink("dc") < 0){
+    printf("%s: unlink dc failed\n", s);
+    exit(1);
+  }
+}
+
+// fill a directory well past one block, so that it becomes
+// indexed and its leaves split, and check that every name
+// can still be found, removed, and read back as entries.
+void
+dirindex(char *s)
+{
+  enum { N = 400 };
+  char name[10];
+  struct dirent de;
+  struct stat st;
+  int i, fd, n;
+
+  if(mkdir("di") < 0 || (fd = open("di/x", O_CREATE|O_RDWR)) < 0){
+    printf("%s: mkdir di failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  name[0] = 'd';
+  name[1] = 'i';
+  name[2] = '/';
+  name[3] = 'f';
+  name[7] = '\0';
+  for(i = 0; i < N; i++){
+    name[4] = '0' + i / 100;
+    name[5] = '0' + (i / 10) % 10;
+    name[6] = '0' + i % 10;
+    if(link("di/x", name) < 0){
+      printf("%s: link %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  if(mkdir("di/sub") < 0 || stat("di/sub/../f123", &st) < 0){
+    printf("%s: mkdir in a big directory failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i += 2){
+    name[4] = '0' + i / 100;
+    name[5] = '0' + (i / 10) % 10;
+    name[6] = '0' + i % 10;
+    if(unlink(name) < 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i++){
+    name[4] = '0' + i / 100;
+    name[5] = '0' + (i / 10) % 10;
+    name[6] = '0' + i % 10;
+    if((stat(name, &st) == 0) != (i % 2)){
+      printf("%s: stat %s went wrong\n", s, name);
+      exit(1);
+    }
+  }
+
+  // ".", "..", "x", "sub", and the odd names.
+  if((fd = open("di", O_RDONLY)) < 0){
+    printf("%s: open di failed\n", s);
+    exit(1);
+  }
+  n = 0;
+  while(read(fd, &de, sizeof(de)) == sizeof(de)){
+    if(de.inum != 0)
+      n++;
+  }
+  close(fd);
+  if(n != 4 + N/2){
+    printf("%s: di has %d entries, not %d\n", s, n, 4 + N/2);
+    exit(1);
+  }
+
+  for(i = 1; i < N; i += 2){
+    name[4] = '0' + i / 100;
+    name[5] = '0' + (i / 10) % 10;
+    name[6] = '0' + i % 10;
+    if(unlink(name) < 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  if(unlink("di") == 0){
+    printf("%s: unlinked a non-empty directory\n", s);
+    exit(1);
+  }
+  if(unlink("di/sub") < 0 || unlink("di/x") < 0 || unlink("di") < 0){
+    printf("%s: unlink di failed\n", s);
+    exit(1);
+  }
+}
+
 void
 sbrkbasic(char *s)
 {
@@ -2364,6 +3338,34 @@ stacktest(char *s)
     exit(xstatus);
 }
 
+// check that system calls can't use the page beneath
+// the user stack either.
+void
+stackcopy(char *s)
+{
+  int fd;
+  char *guard = (char *) (PGROUNDDOWN(r_sp()) - PGSIZE);
+
+  fd = open("README", 0);
+  if(fd < 0){
+    printf("%s: open README failed\n", s);
+    exit(1);
+  }
+  if(read(fd, guard, 10) != -1){
+    printf("%s: read into guard page succeeded\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(write(1, guard, 10) != -1){
+    printf("%s: write from guard page succeeded\n", s);
+    exit(1);
+  }
+  if(open(guard + PGSIZE - 4, 0) != -1){
+    printf("%s: open of guard page name succeeded\n", s);
+    exit(1);
+  }
+}
+
 // regression test. copyin(), copyout(), and copyinstr() used to cast
 // the virtual page address to uint, which (with certain wild system
 // call arguments) resulted in a kernel page faults.
@@ -2676,6 +3678,7 @@ main(int argc, char *argv[])
     {sbrkarg, "sbrkarg"},
     {validatetest, "validatetest"},
     {stacktest, "stacktest"},
+    {stackcopy, "stackcopy"},
     {opentest, "opentest"},
     {writetest, "writetest"},
     {writebig, "writebig"},
@@ -2693,6 +3696,21 @@ main(int argc, char *argv[])
     {dirfile, "dirfile"},
     {iref, "iref"},
     {forktest, "forktest"},
+    {cowfork, "cowfork"},
+    {lazyexec, "lazyexec"},
+    {fsynctest, "fsynctest"},
+    {priority, "priority"},
+    {ucopytest, "ucopytest"},
+    {copybw, "copybw"},
+    {threads, "threads"},
+    {futextest, "futextest"},
+    {megapages, "megapages"},
+    {manyfiles, "manyfiles"},
+    {pipebw, "pipebw"},
+    {splicetest, "splicetest"},
+    {icachetest, "icachetest"},
+    {dcachetest, "dcachetest"},
+    {dirindex, "dirindex"},
     {bigdir, "bigdir"}, // slow
     { 0, 0},
   };
@@ -36,3 +36,9 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("fsync");
+entry("setpriority");
+entry("clone");
+entry("join");
+entry("futex");
+entry("splice");
@@ -0,0 +1,112 @@
+// Measure the cost of sleep/wakeup.
+//
+// wakebench bounces a byte between two processes over a pair
+// of pipes for DURATION clock ticks; every round trip is two
+// sleeps and two wakeups.  It does so with 0, STEP, 2*STEP, ...
+// other processes asleep reading a pipe that nobody writes,
+// to show how wakeup() cost depends on the number of
+// processes that are asleep on other channels.  Rebuild with a different NPROC
+// in kernel/param.h to see how it depends on the size of proc[].
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/param.h"
+#include "user/user.h"
+
+#define DURATION 10  // ticks each measurement runs for
+#define STEP     16  // sleepers added per measurement
+#define SPARE    8   // proc[] slots left for init, sh, &c
+
+// fork a process that sleeps reading fd until it is closed.
+void
+sleeper(int fds[2])
+{
+  char c;
+  int pid = fork();
+
+  if(pid < 0){
+    printf("wakebench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[1]);
+    read(fds[0], &c, 1);
+    exit(0);
+  }
+}
+
+// bounce a byte until DURATION ticks have passed;
+// return the number of round trips.
+int
+pingpong(void)
+{
+  int ping[2], pong[2];
+  int n, t0, pid;
+  char c = 0;
+
+  if(pipe(ping) < 0 || pipe(pong) < 0){
+    printf("wakebench: pipe failed\n");
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("wakebench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    // echo until the parent closes ping.
+    close(ping[1]);
+    close(pong[0]);
+    while(read(ping[0], &c, 1) == 1)
+      write(pong[1], &c, 1);
+    exit(0);
+  }
+  close(ping[0]);
+  close(pong[1]);
+
+  n = 0;
+  t0 = uptime();
+  while(uptime() - t0 < DURATION){
+    if(write(ping[1], &c, 1) != 1 || read(pong[0], &c, 1) != 1){
+      printf("wakebench: ping-pong failed\n");
+      exit(1);
+    }
+    n++;
+  }
+  close(ping[1]);
+  close(pong[0]);
+  wait(0);
+  return n;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int fds[2], n, nsleep;
+
+  if(pipe(fds) < 0){
+    printf("wakebench: pipe failed\n");
+    exit(1);
+  }
+
+  printf("wakebench: NPROC %d, %d ticks per run\n", NPROC, DURATION);
+  nsleep = 0;
+  for(;;){
+    n = pingpong();
+    printf("%d sleepers: %d round trips, %d per tick\n",
+           nsleep, n, n / DURATION);
+    if(nsleep + STEP > NPROC - SPARE)
+      break;
+    for(int i = 0; i < STEP; i++)
+      sleeper(fds);
+    nsleep += STEP;
+  }
+
+  // wake the sleepers: read() returns 0 once the last
+  // write end is closed.
+  close(fds[1]);
+  close(fds[0]);
+  while(wait(0) >= 0)
+    ;
+  exit(0);
+}